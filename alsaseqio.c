@@ -1,211 +1,3401 @@
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 #include <limits.h>
+#include <malloc.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <poll.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <alsa/asoundlib.h>
 #include "arg.h"
 #include "fatal.h"
+#include "intpack.h"
+#include "midifilter.h"
+#include "midiparse.h"
+#include "ring.h"
+#include "seqmidi.h"
+#include "shmring.h"
 #include "spawn.h"
 
 #define LEN(a) (sizeof (a) / sizeof *(a))
 
+enum {
+	FRAMEHDR = 12,  /* time (le64), client, port, length (le16) */
+	LARGESYSEX = 65536,  /* minimum dump size for transfer rate reporting */
+	TAPSIZE = 1 << 20,  /* size of the ring shared by -T consumers */
+	TAPMARKS = TAPSIZE / 4,  /* number of write positions kept for -T consumers to resume at */
+};
+
+/* UMP packet size in 32-bit words, indexed by message type */
+static const unsigned char umpwords[16] = {1, 1, 1, 2, 2, 4, 1, 1, 2, 2, 2, 3, 3, 4, 4, 4};
+
 static snd_seq_t *seq;
-static snd_midi_event_t *dev;
+static int queue = -1;
+static long long queuebase;  /* monotonic clock at queue time 0 */
+static long outlatency, lookahead;
+static long sysexchunk, pacerate, sysexgap;
+static long cowindow;
+static int eflag, tflag, uflag, vflag, zflag;
+static unsigned long outbatch;
+static unsigned long nlate;
+static long long maxlate;
+static struct midifilter filter;
+static int fflag;
+static unsigned long ndumps;
+static unsigned long long dumpbytes;
+static long long dumptime;
+/* announcements and reconnection statistics in -P mode */
+static snd_seq_t *announceseq;
+static int Pflag;
+static unsigned long nreconnects;
+static long long maxreconnect, downtime;
+/* socket of -D mode, where clients are handed pipes to the ports */
+static const char *daemonpath;
+static int mflag;
+/* socket of -T mode, where consumers share the messages read from the port */
+static const char *tappath;
+
+/* threads given a scheduling policy and CPUs with -x */
+enum {
+	XREAD,  /* midireader, or the -e event loop */
+	XWRITE,  /* inputreader */
+	XQUEUE,  /* ringwriter */
+	XWORKER,
+};
+
+struct xsched {
+	int set, policy, prio;
+	int pin;
+	cpu_set_t cpus;
+};
+
+static int xflag;
+static struct xsched xsched[4];
+
+/*
+Counters of a thread. Only the thread itself writes them, with relaxed
+loads and stores rather than locked operations, and anyone may read
+them at any time.
+*/
+struct stats {
+	char name[16];
+	atomic_ulong revents, rbytes;  /* read from the port and written to wfd */
+	atomic_ulong wevents, wbytes;  /* read from rfd and written to the port */
+	atomic_ulong drains, errors, overruns, maxbatch;
+	/* time from the event timestamp to write, in log2 microsecond buckets */
+	atomic_ulong latency[24];
+	atomic_llong latsum, latmax;
+	struct stats *next;
+};
+
+/* stamp incoming events for the latency histogram */
+static int stampflag;
+static long long starttime;
+/* socket and descriptor statistics are served on */
+static const char *statspath;
+static int statsfd = -1;
+/* threads that do not count anything share these */
+static struct stats otherstats = {.name = "other"};
+static struct stats *allstats = &otherstats;
+static pthread_mutex_t statslock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local struct stats *stats = &otherstats;
+
+enum {
+	QNONE,
+	QBLOCK,
+	QOLDEST,
+	QREALTIME,
+	QCOALESCE,
+};
+
+/* messages queued for wfd */
+struct msgq {
+	struct ring ring;
+	struct midiparser parser;
+	unsigned long queued, blocked, dropped, coalesced;
+	unsigned long unread;  /* dropped for a -D client that does not read */
+	/* dropping the rest of a system exclusive message with -q oldest */
+	int dropsysex;
+	/* pending controller, channel pressure, and pitch bend messages */
+	size_t nctl;
+	unsigned short ctlorder[16 * 130];
+	unsigned char ctlmsg[16 * 130][3];
+};
+
+/*
+Controller, channel pressure, and pitch bend events held back for the
+coalescing window, keeping only the latest value of each.
+*/
+struct coalesce {
+	long long deadline;
+	unsigned long in, out;
+	size_t n;
+	unsigned short order[16 * 130];
+	snd_seq_event_t evt[16 * 130];
+};
+
+/* state for MIDI read from rfd */
+struct input {
+	snd_seq_event_t evt;
+	struct midiparser parser;
+	size_t hdrpos, framelen;
+	unsigned char hdr[FRAMEHDR];
+	long long next;  /* queue time at which the port is free in -R or -g mode */
+	int dropsysex;
+	struct coalesce *co;
+	/* UMP packet in -u mode */
+	snd_seq_ump_event_t uevt;
+	unsigned char ump[16];
+	size_t umppos;
+};
+
+struct port {
+	const char *target;
+	snd_seq_addr_t dest;
+	int self, mode;
+	int fd[2];
+	snd_midi_event_t *dev;
+	struct input in;
+	struct msgq *q;
+	/* system exclusive dump in progress */
+	long long dumpstart;
+	size_t dumplen;
+	unsigned char runstatus;  /* last status written to wfd in -z mode */
+	atomic_int newstatus;  /* reset runstatus for a new client in -D mode */
+	int insysex;  /* the queue is in the middle of a system exclusive message */
+	int skipsysex;  /* drop the rest of it, after a -D client's pipe was full */
+	struct coalesce *co;
+	/* whether the target is subscribed, and since when it is not in -P mode */
+	int connected;
+	long long lost;
+	/* client holding the pipes in -D mode; fdlock guards fd and client */
+	atomic_int attached;
+	pthread_mutex_t fdlock;
+	unsigned client;  /* counts the clients given rfd */
+	unsigned inclient;  /* the client in.parser is for, owned by the worker */
+	struct worker *worker;
+	/* shared memory rings used in place of fd in -m mode */
+	struct shmring *ring[2];
+};
+
+struct worker {
+	pthread_t thread;
+	int id, cpu;
+	int ep, wakefd;
+	struct port **ports;
+	size_t nports;
+};
+
+/* consumer of -T mode, with its own cursor into the tap ring */
+struct consumer {
+	int fd, id;
+	pid_t pid;
+	unsigned long long pos;  /* of the next byte to take from the ring */
+	unsigned long long sent, maxlag, dropped;
+	int partial;  /* pos is within a write */
+	int blocked;  /* waiting for room in its socket */
+	int gone;
+	/* taken from the ring, but not yet sent */
+	size_t start, end;
+	unsigned char buf[4096];
+	struct consumer *next;
+};
+
+/*
+Messages read from the port in -T mode. The reader appends to the ring
+without waiting for anyone, and a consumer that falls more than a
+ring behind skips ahead to the oldest write still held whole. Writes
+consist of whole messages, or frames in -t mode.
+*/
+static struct {
+	pthread_mutex_t lock;
+	unsigned char *buf;
+	unsigned long long head;  /* bytes written in total */
+	unsigned long long *marks, nmarks;  /* positions of the last writes */
+	int waiting, wakefd;
+	struct consumer *consumers;
+	int nconsumers;
+} tap = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static int qpolicy;
+static struct port *ports;
+static size_t nports;
+static struct port *portmap[256];
+static pthread_mutex_t outlock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: alsaseqio [-emPrstuvwz] [-a usec] [-B bytes] [-L usec] [-C bytes] [-R bytes/s] [-g usec] [-F filter] [-K usec] [-q policy] [-Q slots] [-f rfd,wfd] [-x sched] [-S socket] [-o fd] [-n name] [-p client:port] [command...]\n"
+	                "       alsaseqio [-Prsvwz] [-B bytes] [-C bytes] [-R bytes/s] [-g usec] [-F filter] [-K usec] [-q policy] [-Q slots] [-j workers] [-x sched] [-S socket] [-o fd] [-n name] [-c file | -f rfd,wfd -p client:port...]\n"
+	                "       alsaseqio [-rsvwz] [-B bytes] [-C bytes] [-R bytes/s] [-g usec] [-F filter] [-K usec] [-q policy] [-Q slots] [-j workers] [-x sched] [-S socket] [-o fd] [-n name] -D socket -p client:port...\n"
+	                "       alsaseqio -A socket [-f rfd,wfd] -p client:port command...\n"
+	                "       alsaseqio -T socket [-Prstuv] [-F filter] [-K usec] [-x sched] [-S socket] [-o fd] [-n name] [-p client:port]\n"
+	                "       alsaseqio -l [-JWrw] [-n name]\n");
+	exit(1);
+}
+
+static int
+getportmode(snd_seq_port_info_t *info)
+{
+	int caps, mode;
+
+	caps = snd_seq_port_info_get_capability(info);
+	mode = 0;
+	if (caps & SND_SEQ_PORT_CAP_READ && caps & SND_SEQ_PORT_CAP_SUBS_READ)
+		mode |= READ;
+	if (caps & SND_SEQ_PORT_CAP_WRITE && caps & SND_SEQ_PORT_CAP_SUBS_WRITE)
+		mode |= WRITE;
+	return mode;
+}
+
+/* port table for -l, ordered by address */
+struct portent {
+	int client, port, mode;
+	int seen;
+	char cname[64], pname[64];
+};
+
+static struct portent *porttab;
+static size_t nporttab, porttabcap;
+static snd_seq_client_info_t *clientinfo;
+static snd_seq_port_info_t *portinfo;
+static int jflag, Wflag;
+
+static void
+putjson(const char *s)
+{
+	putchar('"');
+	for (; *s; ++s) {
+		if (*s == '"' || *s == '\\')
+			printf("\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			printf("\\u%04x", *s);
+		else
+			putchar(*s);
+	}
+	putchar('"');
+}
+
+/* prints a port, and in -W mode, what happened to it */
+static void
+printport(const char *what, const struct portent *e)
+{
+	if (jflag) {
+		putchar('{');
+		if (Wflag)
+			printf("\"event\":\"%s\",", what);
+		printf("\"client\":%d,\"port\":%d,\"mode\":\"%s%s\",\"client_name\":",
+			e->client, e->port, e->mode & READ ? "r" : "", e->mode & WRITE ? "w" : "");
+		putjson(e->cname);
+		printf(",\"port_name\":");
+		putjson(e->pname);
+		printf("}\n");
+		return;
+	}
+	if (Wflag)
+		printf("%-7s", what);
+	printf("%3d:%-3d %c%c\t%-32s %s\n",
+		e->client, e->port,
+		e->mode & READ ? 'r' : '-',
+		e->mode & WRITE ? 'w' : '-',
+		e->cname, e->pname);
+}
+
+static struct portent *
+findport(int client, int port)
+{
+	size_t i;
+
+	for (i = 0; i < nporttab; ++i) {
+		if (porttab[i].client == client && porttab[i].port == port)
+			return &porttab[i];
+	}
+	return NULL;
+}
+
+static void
+removeport(struct portent *e)
+{
+	printport("remove", e);
+	--nporttab;
+	memmove(e, e + 1, (porttab + nporttab - e) * sizeof *e);
+}
+
+/* adds or updates the table entry for a port that exists */
+static void
+setport(const struct portent *new)
+{
+	struct portent *e;
+	size_t i;
+
+	e = findport(new->client, new->port);
+	if (e) {
+		e->seen = 1;
+		if (e->mode == new->mode && strcmp(e->cname, new->cname) == 0 && strcmp(e->pname, new->pname) == 0)
+			return;
+		*e = *new;
+		e->seen = 1;
+		printport("change", e);
+		return;
+	}
+	if (nporttab == porttabcap) {
+		porttabcap = porttabcap ? porttabcap * 2 : 64;
+		porttab = realloc(porttab, porttabcap * sizeof *porttab);
+		if (!porttab)
+			fatal("realloc:");
+	}
+	for (i = nporttab; i > 0 && (porttab[i - 1].client > new->client || (porttab[i - 1].client == new->client && porttab[i - 1].port > new->port)); --i)
+		;
+	memmove(porttab + i + 1, porttab + i, (nporttab - i) * sizeof *porttab);
+	++nporttab;
+	porttab[i] = *new;
+	porttab[i].seen = 1;
+	printport("add", &porttab[i]);
+}
+
+static void
+fillport(struct portent *e)
+{
+	e->client = snd_seq_port_info_get_client(portinfo);
+	e->port = snd_seq_port_info_get_port(portinfo);
+	e->mode = getportmode(portinfo);
+	snprintf(e->cname, sizeof e->cname, "%s", snd_seq_client_info_get_name(clientinfo));
+	snprintf(e->pname, sizeof e->pname, "%s", snd_seq_port_info_get_name(portinfo));
+}
+
+/* queries every port, and updates the table to match */
+static void
+scanports(int mode)
+{
+	int err;
+	struct portent e;
+	size_t i;
+
+	for (i = 0; i < nporttab; ++i)
+		porttab[i].seen = 0;
+	snd_seq_client_info_set_client(clientinfo, -1);
+	for (;;) {
+		err = snd_seq_query_next_client(seq, clientinfo);
+		if (err == -ENOENT)
+			break;
+		if (err)
+			fatal("snd_seq_query_next_client: %s", snd_strerror(err));
+		snd_seq_port_info_set_client(portinfo, snd_seq_client_info_get_client(clientinfo));
+		snd_seq_port_info_set_port(portinfo, -1);
+		for (;;) {
+			err = snd_seq_query_next_port(seq, portinfo);
+			if (err == -ENOENT)
+				break;
+			if (err)
+				fatal("snd_seq_query_next_port: %s", snd_strerror(err));
+			fillport(&e);
+			if (mode & e.mode)
+				setport(&e);
+		}
+	}
+	for (i = nporttab; i > 0; --i) {
+		if (!porttab[i - 1].seen)
+			removeport(&porttab[i - 1]);
+	}
+}
+
+/* queries one port, after an announcement about it */
+static void
+updateport(int mode, int client, int port)
+{
+	int err;
+	struct portent e, *old;
+
+	err = snd_seq_get_any_client_info(seq, client, clientinfo);
+	if (!err)
+		err = snd_seq_get_any_port_info(seq, client, port, portinfo);
+	if (!err) {
+		fillport(&e);
+		if (mode & e.mode) {
+			setport(&e);
+			return;
+		}
+	}
+	/* gone, or no longer matching */
+	old = findport(client, port);
+	if (old)
+		removeport(old);
+}
+
+/*
+Lists the ports matching mode. In -W mode, the list is printed as
+additions, and then the table is kept up to date from the system
+announce port, printing each change as it happens.
+*/
+static void
+listports(int mode)
+{
+	snd_seq_event_t *evt;
+	struct portent *e;
+	int err, self;
+	size_t i;
+
+	err = snd_seq_client_info_malloc(&clientinfo);
+	if (err)
+		fatal("snd_seq_client_info_malloc: %s", snd_strerror(err));
+	err = snd_seq_port_info_malloc(&portinfo);
+	if (err)
+		fatal("snd_seq_port_info_malloc: %s", snd_strerror(err));
+	if (Wflag) {
+		/* subscribe before scanning, so that nothing is missed in between */
+		self = snd_seq_create_simple_port(seq, "announce", SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_NO_EXPORT, SND_SEQ_PORT_TYPE_APPLICATION);
+		if (self < 0)
+			fatal("snd_seq_create_simple_port: %s", snd_strerror(self));
+		err = snd_seq_connect_from(seq, self, SND_SEQ_CLIENT_SYSTEM, SND_SEQ_PORT_SYSTEM_ANNOUNCE);
+		if (err)
+			fatal("snd_seq_connect_from: %s", snd_strerror(err));
+	}
+	scanports(mode);
+	while (Wflag) {
+		fflush(stdout);
+		err = snd_seq_event_input(seq, &evt);
+		if (err == -ENOSPC) {
+			/* announcements were lost */
+			scanports(mode);
+			continue;
+		}
+		if (err < 0)
+			fatal("snd_seq_event_input: %s", snd_strerror(err));
+		switch (evt->type) {
+		case SND_SEQ_EVENT_PORT_START:
+		case SND_SEQ_EVENT_PORT_CHANGE:
+		case SND_SEQ_EVENT_PORT_EXIT:
+			updateport(mode, evt->data.addr.client, evt->data.addr.port);
+			break;
+		case SND_SEQ_EVENT_CLIENT_CHANGE:
+		case SND_SEQ_EVENT_CLIENT_EXIT:
+			/* a renamed client changes the names of its ports */
+			for (i = nporttab; i > 0; --i) {
+				e = &porttab[i - 1];
+				if (e->client == evt->data.addr.client)
+					updateport(mode, e->client, e->port);
+			}
+			break;
+		}
+	}
+}
+
+static void
+writevfull(int fd, struct iovec *iov, int n)
+{
+	ssize_t ret;
+
+	while (n > 0) {
+		ret = writev(fd, iov, n);
+		if (ret < 0) {
+			perror("writev");
+			exit(1);
+		}
+		for (; n > 0 && ret >= iov->iov_len; --n, ++iov)
+			ret -= iov->iov_len;
+		if (n > 0) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+}
+
+static void
+writefull(int fd, const unsigned char *buf, size_t len)
+{
+	const unsigned char *pos;
+	ssize_t ret;
+
+	pos = buf;
+	while (len > 0) {
+		ret = write(fd, pos, len);
+		if (ret < 0) {
+			perror("write");
+			exit(1);
+		}
+		pos += ret;
+		len -= ret;
+	}
+}
+
+static void
+tapput(const struct iovec *iov, int niov)
+{
+	const unsigned char *buf;
+	size_t off, len, n;
+	uint64_t one;
+	int i, wake;
+
+	pthread_mutex_lock(&tap.lock);
+	tap.marks[tap.nmarks++ & (TAPMARKS - 1)] = tap.head;
+	for (i = 0; i < niov; ++i) {
+		buf = iov[i].iov_base;
+		len = iov[i].iov_len;
+		while (len > 0) {
+			off = tap.head & (TAPSIZE - 1);
+			n = TAPSIZE - off < len ? TAPSIZE - off : len;
+			memcpy(tap.buf + off, buf, n);
+			tap.head += n;
+			buf += n;
+			len -= n;
+		}
+	}
+	wake = tap.waiting;
+	tap.waiting = 0;
+	pthread_mutex_unlock(&tap.lock);
+	if (wake) {
+		one = 1;
+		if (write(tap.wakefd, &one, sizeof one) < 0)
+			fatal("write:");
+	}
+}
+
+static void
+statadd(atomic_ulong *c, unsigned long n)
+{
+	atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static void
+statmax(atomic_ulong *c, unsigned long n)
+{
+	if (n > atomic_load_explicit(c, memory_order_relaxed))
+		atomic_store_explicit(c, n, memory_order_relaxed);
+}
+
+/* gives the calling thread its own counters */
+static void
+newstats(const char *name)
+{
+	struct stats *s;
+	int err;
+
+	err = posix_memalign((void **)&s, 64, sizeof *s);
+	if (err)
+		fatal("posix_memalign: %s", strerror(err));
+	memset(s, 0, sizeof *s);
+	snprintf(s->name, sizeof s->name, "%s", name);
+	pthread_mutex_lock(&statslock);
+	s->next = allstats;
+	allstats = s;
+	pthread_mutex_unlock(&statslock);
+	stats = s;
+}
+
+/* writes to wfd, its ring in -m mode, or the tap ring in -T mode */
+static void
+writeout(struct port *p, const unsigned char *buf, size_t len)
+{
+	struct iovec iov;
+
+	statadd(&stats->rbytes, len);
+	if (tappath) {
+		iov.iov_base = (void *)buf;
+		iov.iov_len = len;
+		tapput(&iov, 1);
+		return;
+	}
+	if (!p->ring[1]) {
+		writefull(p->fd[1], buf, len);
+		return;
+	}
+	if (shmringwrite(p->ring[1], buf, len) != 0)
+		exit(1);  /* closed by the reader, as with EPIPE */
+}
+
+static void
+writeoutv(struct port *p, struct iovec *iov, int n)
+{
+	int i;
+
+	for (i = 0; i < n; ++i)
+		statadd(&stats->rbytes, iov[i].iov_len);
+	if (tappath) {
+		tapput(iov, n);
+		return;
+	}
+	if (!p->ring[1]) {
+		writevfull(p->fd[1], iov, n);
+		return;
+	}
+	for (i = 0; i < n; ++i) {
+		if (shmringwrite(p->ring[1], iov[i].iov_base, iov[i].iov_len) != 0)
+			exit(1);
+	}
+}
+
+/* index of a message in the coalescing table, or -1 */
+static int
+ctlindex(const unsigned char *m)
+{
+	switch (m[0] >> 4) {
+	case 0xB: return (m[0] & 0xF) * 130 + m[1];
+	case 0xD: return (m[0] & 0xF) * 130 + 128;
+	case 0xE: return (m[0] & 0xF) * 130 + 129;
+	}
+	return -1;
+}
+
+/* queue real time in nanoseconds, extrapolated from the monotonic clock */
+static long long
+queuetime(void)
+{
+	return monotime() - queuebase;
+}
+
+/*
+Applies the -x settings of the calling thread, and faults in enough of
+its stack that it does not take page faults once running.
+*/
+static void
+setsched(int thread)
+{
+	struct xsched *x;
+	struct sched_param param;
+	volatile unsigned char stack[65536];
+	size_t i;
+	long page;
+	int err;
+
+	x = &xsched[thread];
+	if (!x->set)
+		return;
+	param.sched_priority = x->prio;
+	err = pthread_setschedparam(pthread_self(), x->policy, &param);
+	if (err)
+		fatal("pthread_setschedparam: %s", strerror(err));
+	if (x->pin) {
+		err = pthread_setaffinity_np(pthread_self(), sizeof x->cpus, &x->cpus);
+		if (err)
+			fatal("pthread_setaffinity_np: %s", strerror(err));
+	}
+	/* fault in the stack a page at a time, with stores the compiler must keep */
+	page = sysconf(_SC_PAGESIZE);
+	if (page <= 0)
+		page = 4096;
+	for (i = 0; i < sizeof stack; i += page)
+		stack[i] = 0;
+}
+
+/* index of an event in the coalescing window, or -1 */
+static int
+coalesceindex(const snd_seq_event_t *evt)
+{
+	switch (evt->type) {
+	case SND_SEQ_EVENT_CONTROLLER:
+		if (evt->data.control.param > 127)
+			return -1;
+		return (evt->data.control.channel & 0xF) * 130 + evt->data.control.param;
+	case SND_SEQ_EVENT_CHANPRESS:
+		return (evt->data.control.channel & 0xF) * 130 + 128;
+	case SND_SEQ_EVENT_PITCHBEND:
+		return (evt->data.control.channel & 0xF) * 130 + 129;
+	}
+	return -1;
+}
+
+/*
+Stores evt in the coalescing window, replacing the previous value for
+its channel and controller. Returns 0 if evt must be sent as it is, in
+which case any held back events must be sent first unless evt is a
+system real-time message.
+*/
+static int
+coalesce(struct coalesce *co, const snd_seq_event_t *evt)
+{
+	int i;
+
+	i = coalesceindex(evt);
+	if (i < 0)
+		return 0;
+	++co->in;
+	if (co->evt[i].type == SND_SEQ_EVENT_NONE) {
+		if (co->n == 0)
+			co->deadline = monotime() + cowindow * 1000;
+		co->order[co->n++] = i;
+	}
+	co->evt[i] = *evt;
+	return 1;
+}
+
+/* calls fn for the held back events in order and clears the window */
+static void
+flushcoalesce(struct coalesce *co, void (*fn)(void *, snd_seq_event_t *), void *arg)
+{
+	snd_seq_event_t *evt;
+	size_t i;
+
+	for (i = 0; i < co->n; ++i) {
+		evt = &co->evt[co->order[i]];
+		fn(arg, evt);
+		evt->type = SND_SEQ_EVENT_NONE;
+	}
+	co->out += co->n;
+	co->n = 0;
+}
+
+static struct coalesce *
+newcoalesce(void)
+{
+	struct coalesce *co;
+	size_t i;
+
+	co = malloc(sizeof *co);
+	if (!co)
+		fatal("malloc:");
+	co->n = 0;
+	co->in = 0;
+	co->out = 0;
+	for (i = 0; i < LEN(co->evt); ++i)
+		co->evt[i].type = SND_SEQ_EVENT_NONE;
+	return co;
+}
+
+static int
+isrealtime(const snd_seq_event_t *evt)
+{
+	return seqtypestatus[evt->type] >= 0xF8;
+}
+
+static int
+flushctl(struct msgq *q, int block)
+{
+	unsigned char *m;
+	size_t i;
+
+	for (i = 0; i < q->nctl; ++i) {
+		m = q->ctlmsg[q->ctlorder[i]];
+		while (!ringput(&q->ring, m, miditab[m[0]] & MIDI_LEN)) {
+			if (!block) {
+				/* keep the rest, each at most once, for the next flush */
+				q->nctl -= i;
+				memmove(q->ctlorder, q->ctlorder + i, q->nctl * sizeof *q->ctlorder);
+				return 0;
+			}
+			++q->blocked;
+			ringwait(&q->ring, ringfull);
+		}
+		++q->queued;
+		m[0] = 0;
+	}
+	q->nctl = 0;
+	return 1;
+}
+
+/*
+Drops the oldest queued message. A system exclusive message split over
+several slots is dropped up to its end, or marked to drop the slots
+still to come, so the writer never sees the middle of one go missing.
+*/
+static void
+dropoldest(struct msgq *q)
+{
+	unsigned char m[RINGDATA];
+	size_t n;
+	int insysex;
+
+	insysex = 0;
+	do {
+		n = ringget(&q->ring, m);
+		if (n == 0) {
+			if (insysex)
+				q->dropsysex = 1;
+			else
+				sched_yield();  /* writer is copying the oldest */
+			return;
+		}
+		if (m[0] < 0x80 || m[0] == 0xF0 || m[0] == 0xF7)
+			insysex = m[n - 1] != 0xF7;
+		else if (!(miditab[m[0]] & MIDI_REALTIME))
+			insysex = 0;
+	} while (insysex);
+	++q->dropped;
+}
+
+/* whether m is part of a system exclusive message being dropped */
+static int
+droprest(struct msgq *q, const unsigned char *m, size_t len)
+{
+	if (!q->dropsysex || miditab[m[0]] & MIDI_REALTIME)
+		return 0;
+	if (m[0] < 0x80 || m[0] == 0xF7) {
+		q->dropsysex = m[len - 1] != 0xF7;
+		return 1;
+	}
+	q->dropsysex = 0;
+	return 0;
+}
+
+static void
+queuemsg(struct msgq *q, const unsigned char *m, size_t len)
+{
+	int i;
+
+	if (droprest(q, m, len))
+		return;
+	switch (qpolicy) {
+	case QREALTIME:
+		/* shed real-time messages to leave room for the others */
+		if (miditab[m[0]] & MIDI_REALTIME && ringcount(&q->ring) >= (q->ring.mask + 1) / 4 * 3) {
+			++q->dropped;
+			return;
+		}
+		break;
+	case QCOALESCE:
+		i = ctlindex(m);
+		if (i >= 0 && (q->nctl > 0 || ringfull(&q->ring))) {
+			if (q->ctlmsg[i][0])
+				++q->coalesced;
+			else
+				q->ctlorder[q->nctl++] = i;
+			memcpy(q->ctlmsg[i], m, len);
+			return;
+		}
+		if (q->nctl > 0)
+			flushctl(q, 1);
+		break;
+	}
+	while (!ringput(&q->ring, m, len)) {
+		if (qpolicy == QOLDEST) {
+			dropoldest(q);
+			if (droprest(q, m, len))
+				return;
+			continue;
+		}
+		++q->blocked;
+		ringwait(&q->ring, ringfull);
+	}
+	++q->queued;
+}
+
+static void
+queuemidi(struct msgq *q, const unsigned char *buf, size_t len)
+{
+	struct midimsg msg;
+	size_t ret, n;
+
+	while (len > 0) {
+		ret = midiparse(&q->parser, buf, len, &msg);
+		buf += ret;
+		len -= ret;
+		while (msg.len > 0) {
+			n = msg.len < RINGDATA ? msg.len : RINGDATA;
+			queuemsg(q, msg.data, n);
+			msg.data += n;
+			msg.len -= n;
+		}
+	}
+}
+
+static void
+emit(struct port *p, const unsigned char *buf, size_t len)
+{
+	if (p->q)
+		queuemidi(p->q, buf, len);
+	else
+		writeout(p, buf, len);
+}
+
+static int
+flushallctl(void)
+{
+	size_t i;
+	int done;
+
+	done = 1;
+	for (i = 0; i < nports; ++i) {
+		if (ports[i].q && !flushctl(ports[i].q, 0))
+			done = 0;
+	}
+	return done;
+}
+
+static void
+putframehdr(unsigned char *pos, const snd_seq_event_t *evt, size_t len)
+{
+	uint_least64_t t;
+
+	t = 0;
+	if (snd_seq_ev_is_real(evt))
+		t = evt->time.time.tv_sec * UINT64_C(1000000000) + evt->time.time.tv_nsec;
+	pos = putle64(pos, t);
+	*pos++ = evt->source.client;
+	*pos++ = evt->source.port;
+	putle16(pos, len);
+}
+
+/*
+Decodes evt to pos, preceded by a frame header in -t mode, or with
+running status in -z mode unless it is queued, in which case running
+status is applied as it is taken from the queue.
+*/
+static long
+decodeevent(struct port *p, unsigned char *pos, unsigned char *end, const snd_seq_event_t *evt)
+{
+	long ret;
+
+	if (!tflag) {
+		ret = snd_midi_event_decode(p->dev, pos, end - pos, evt);
+		if (ret > 0 && zflag && !p->q)
+			ret = midirunstatus(&p->runstatus, pos, ret);
+		return ret;
+	}
+	if (end - pos < FRAMEHDR)
+		return -ENOMEM;
+	ret = snd_midi_event_decode(p->dev, pos + FRAMEHDR, end - pos - FRAMEHDR, evt);
+	if (ret < 0)
+		return ret;
+	putframehdr(pos, evt, ret);
+	return FRAMEHDR + ret;
+}
+
+/* tracks the transfer rate of large system exclusive dumps */
+static void
+sysexstats(struct port *p, const unsigned char *data, size_t len)
+{
+	long long t;
+
+	if (len == 0)
+		return;
+	if (data[0] == 0xF0) {
+		p->dumpstart = monotime();
+		p->dumplen = 0;
+	}
+	p->dumplen += len;
+	if (data[len - 1] != 0xF7 || p->dumplen < LARGESYSEX)
+		return;
+	t = monotime() - p->dumpstart;
+	++ndumps;
+	dumpbytes += p->dumplen;
+	dumptime += t;
+	if (vflag) {
+		fprintf(stderr, "sysex: %zu bytes in %.3f s, %.0f bytes/s\n",
+			p->dumplen, t / 1e9, t > 0 ? p->dumplen * 1e9 / t : 0.0);
+	}
+}
+
+/*
+Writes the decoded messages in buf followed by the payload of a system
+exclusive event, which is written directly from the event rather than
+copied through the decoder.
+*/
+static void
+emitsysex(struct port *p, const unsigned char *buf, size_t len, const snd_seq_event_t *evt)
+{
+	struct iovec iov[3];
+	const unsigned char *data;
+	unsigned char hdr[FRAMEHDR];
+	size_t n, rem;
+	int i;
+
+	data = evt->data.ext.ptr;
+	rem = evt->data.ext.len;
+	sysexstats(p, data, rem);
+	if (p->q) {
+		if (len > 0)
+			queuemidi(p->q, buf, len);
+		queuemidi(p->q, data, rem);
+		return;
+	}
+	p->runstatus = 0;
+	iov[0].iov_base = (void *)buf;
+	iov[0].iov_len = len;
+	do {
+		n = rem;
+		i = 1;
+		if (tflag) {
+			/* split messages longer than the frame length limit */
+			if (n > 0xFFFF)
+				n = 0xFFFF;
+			putframehdr(hdr, evt, n);
+			iov[i].iov_base = hdr;
+			iov[i++].iov_len = FRAMEHDR;
+		}
+		iov[i].iov_base = (void *)data;
+		iov[i++].iov_len = n;
+		writeoutv(p, iov, i);
+		iov[0].iov_len = 0;
+		data += n;
+		rem -= n;
+	} while (rem > 0);
+}
+
+static int
+eventfiltered(const snd_seq_event_t *evt)
+{
+	unsigned char m[2];
+
+	return seqstatus(evt, m) && midifiltered(&filter, m);
+}
+
+/* returns the port an incoming event is for */
+static struct port *
+eventport(const snd_seq_event_t *evt)
+{
+	return nports == 1 ? &ports[0] : portmap[evt->dest.port];
+}
+
+/* MIDI decoded by midireader, not yet written */
+static struct {
+	struct port *port;
+	unsigned char *pos;
+	unsigned char buf[1024];
+	size_t nevents;
+	/* timestamps of the events in buf for the latency histogram */
+	long long stamp[1024];
+	size_t nstamp;
+} out;
+
+static void
+addlatency(long long t)
+{
+	unsigned long long us;
+	int i;
+
+	us = t > 0 ? t / 1000 : 0;
+	for (i = 0; us > 0 && i < LEN(stats->latency) - 1; ++i)
+		us >>= 1;
+	statadd(&stats->latency[i], 1);
+	atomic_store_explicit(&stats->latsum, atomic_load_explicit(&stats->latsum, memory_order_relaxed) + t, memory_order_relaxed);
+	if (t > atomic_load_explicit(&stats->latmax, memory_order_relaxed))
+		atomic_store_explicit(&stats->latmax, t, memory_order_relaxed);
+}
+
+static void
+flushout(void)
+{
+	long long now;
+	size_t i;
+
+	if (out.nstamp > 0) {
+		now = queuetime();
+		for (i = 0; i < out.nstamp; ++i)
+			addlatency(now - out.stamp[i]);
+		out.nstamp = 0;
+	}
+	if (out.pos != out.buf) {
+		emit(out.port, out.buf, out.pos - out.buf);
+		out.pos = out.buf;
+	}
+	if (out.nevents > 0) {
+		statmax(&stats->maxbatch, out.nevents);
+		out.nevents = 0;
+	}
+}
+
+static void
+decodeout(void *arg, snd_seq_event_t *evt)
+{
+	struct port *p;
+	long ret;
+
+	p = arg;
+	if (p != out.port) {
+		flushout();
+		out.port = p;
+	}
+	if (evt->type == SND_SEQ_EVENT_SYSEX && snd_seq_ev_is_variable(evt)) {
+		emitsysex(p, out.buf, out.pos - out.buf, evt);
+		out.pos = out.buf;
+		return;
+	}
+decode:
+	ret = decodeevent(p, out.pos, out.buf + sizeof out.buf, evt);
+	if (ret < 0) {
+		if (ret == -ENOENT)
+			return;  /* not a midi message */
+		if (ret == -ENOMEM && out.pos != out.buf) {
+			flushout();
+			goto decode;
+		}
+		fatal("snd_midi_event_decode: %s", snd_strerror(ret));
+	}
+	out.pos += ret;
+}
+
+/*
+Writes out the expired coalescing windows. Returns the time until the
+next one expires in milliseconds, or -1 if there is none.
+*/
+static int
+expireout(void)
+{
+	struct coalesce *co;
+	long long now, next;
+	size_t i;
+
+	now = monotime();
+	next = -1;
+	for (i = 0; i < nports; ++i) {
+		co = ports[i].co;
+		if (!co || co->n == 0)
+			continue;
+		if (co->deadline - now < 1000000) {
+			flushcoalesce(co, decodeout, &ports[i]);
+			continue;
+		}
+		if (next == -1 || co->deadline < next)
+			next = co->deadline;
+	}
+	flushout();
+	return next == -1 ? -1 : (next - now) / 1000000;
+}
+
+/*
+Flushes coalesced messages and expired coalescing windows while waiting
+for sequencer input.
+*/
+static void
+waitinput(void)
+{
+	static struct pollfd pfd[4];
+	static int npfd;
+	int done, timeout;
+
+	if (npfd == 0) {
+		npfd = snd_seq_poll_descriptors(seq, pfd, LEN(pfd), POLLIN);
+		if (npfd <= 0)
+			fatal("snd_seq_poll_descriptors failed");
+	}
+	while (!snd_seq_event_input_pending(seq, 0)) {
+		done = qpolicy != QCOALESCE || flushallctl();
+		timeout = cowindow > 0 ? expireout() : -1;
+		if (!done && (timeout == -1 || timeout > 1))
+			timeout = 1;
+		if (done && timeout == -1)
+			break;
+		if (poll(pfd, npfd, timeout) > 0)
+			break;
+	}
+}
+
+static void *
+midireader(void *arg)
+{
+	struct port *p;
+	ssize_t ret;
+	snd_seq_event_t *evt;
+
+	newstats("read");
+	setsched(XREAD);
+	out.pos = out.buf;
+	for (;;) {
+		do {
+			if (qpolicy == QCOALESCE || cowindow > 0)
+				waitinput();
+			ret = snd_seq_event_input(seq, &evt);
+			if (ret < 0) {
+				fprintf(stderr, "snd_seq_event_input: %s\n", snd_strerror(ret));
+				if (ret == -ENOSPC) {
+					statadd(&stats->overruns, 1);
+					continue;
+				}
+				exit(1);
+			}
+			p = eventport(evt);
+			if (!p || !(p->mode & READ) || (fflag && eventfiltered(evt)))
+				continue;
+			if (daemonpath && !atomic_load_explicit(&p->attached, memory_order_relaxed))
+				continue;
+			statadd(&stats->revents, 1);
+			++out.nevents;
+			if (stampflag && snd_seq_ev_is_real(evt) && out.nstamp < LEN(out.stamp))
+				out.stamp[out.nstamp++] = evt->time.time.tv_sec * 1000000000ll + evt->time.time.tv_nsec;
+			if (p->co) {
+				if (coalesce(p->co, evt))
+					continue;
+				if (p->co->n > 0 && !isrealtime(evt))
+					flushcoalesce(p->co, decodeout, p);
+			}
+			decodeout(p, evt);
+		} while (snd_seq_event_input_pending(seq, 0) && out.buf + sizeof out.buf - out.pos >= FRAMEHDR + 3);
+		flushout();
+	}
+	return NULL;
+}
+
+/* writes UMP packets read from the sequencer port to wfd as big-endian words */
+static void *
+umpreader(void *arg)
+{
+	struct port *p;
+	snd_seq_ump_event_t *evt;
+	unsigned char buf[1024], *pos;
+	ssize_t ret;
+	int i, n;
+
+	newstats("read");
+	setsched(XREAD);
+	p = &ports[0];
+	for (;;) {
+		pos = buf;
+		do {
+			ret = snd_seq_ump_event_input(seq, &evt);
+			if (ret < 0) {
+				fprintf(stderr, "snd_seq_ump_event_input: %s\n", snd_strerror(ret));
+				if (ret == -ENOSPC) {
+					statadd(&stats->overruns, 1);
+					continue;
+				}
+				exit(1);
+			}
+			if (!(evt->flags & SND_SEQ_EVENT_UMP))
+				continue;  /* not a midi message */
+			statadd(&stats->revents, 1);
+			n = umpwords[evt->ump[0] >> 28];
+			for (i = 0; i < n; ++i)
+				pos = putbe32(pos, evt->ump[i]);
+		} while (snd_seq_event_input_pending(seq, 0) && buf + sizeof buf - pos >= 16);
+		if (pos != buf)
+			writeout(p, buf, pos - buf);
+	}
+	return NULL;
+}
+
+/* takes the next queued message for wfd */
+static size_t
+dequeue(struct port *p, unsigned char *buf)
+{
+	size_t ret;
+	int open;
+
+	for (;;) {
+		ret = ringget(&p->q->ring, buf);
+		if (ret == 0)
+			return 0;
+		if (buf[0] < 0x80 || buf[0] == 0xF0 || buf[0] == 0xF7) {
+			open = buf[ret - 1] != 0xF7;
+			if (p->skipsysex && buf[0] != 0xF0) {
+				p->skipsysex = open;
+				continue;
+			}
+			p->insysex = open;
+		} else if (!(miditab[buf[0]] & MIDI_REALTIME)) {
+			p->insysex = 0;
+		}
+		p->skipsysex = 0;
+		break;
+	}
+	if (zflag) {
+		if (atomic_exchange(&p->newstatus, 0))
+			p->runstatus = 0;
+		ret = midirunstatus(&p->runstatus, buf, ret);
+	}
+	return ret;
+}
+
+static void *
+ringwriter(void *arg)
+{
+	struct port *p;
+	size_t len, ret;
+	unsigned char buf[4096];
+
+	newstats("queue");
+	setsched(XQUEUE);
+	p = arg;
+	len = 0;
+	for (;;) {
+		ret = dequeue(p, buf + len);
+		if (ret > 0) {
+			len += ret;
+			if (sizeof buf - len >= RINGDATA)
+				continue;
+		} else if (len == 0) {
+			ringwait(&p->q->ring, ringempty);
+			continue;
+		}
+		writeout(p, buf, len);
+		len = 0;
+	}
+	return NULL;
+}
+
+/* returns non-zero while events remain in the output buffer */
+static int
+trydrain(void)
+{
+	int ret;
+
+	ret = snd_seq_drain_output(seq);
+	if (ret < 0 && ret != -EAGAIN)
+		fatal("snd_seq_drain_output: %s", snd_strerror(ret));
+	statadd(&stats->drains, 1);
+	if (ret == 0) {
+		statmax(&stats->maxbatch, outbatch);
+		outbatch = 0;
+	}
+	return ret != 0;
+}
+
+static void
+drainoutput(void)
+{
+	while (trydrain())
+		;
+}
+
+static void
+outputevent(snd_seq_event_t *evt)
+{
+	int ret;
+
+	ret = snd_seq_event_output_buffer(seq, evt);
+	if (ret == -EAGAIN) {
+		/* output buffer is full */
+		drainoutput();
+		ret = snd_seq_event_output_buffer(seq, evt);
+	}
+	if (ret < 0)
+		fatal("snd_seq_event_output_buffer: %s", snd_strerror(ret));
+	statadd(&stats->wevents, 1);
+	++outbatch;
+}
+
+static void
+outputump(snd_seq_ump_event_t *evt)
+{
+	int ret;
+
+	ret = snd_seq_ump_event_output_buffer(seq, evt);
+	if (ret == -EAGAIN) {
+		drainoutput();
+		ret = snd_seq_ump_event_output_buffer(seq, evt);
+	}
+	if (ret < 0)
+		fatal("snd_seq_ump_event_output_buffer: %s", snd_strerror(ret));
+	statadd(&stats->wevents, 1);
+	++outbatch;
+}
+
+/*
+Schedules evt on the queue at frame time t. The first frame is played
+after the lookahead, and the rest relative to it.
+*/
+static void
+scheduleevent(snd_seq_event_t *evt, uint_least64_t t)
+{
+	static long long offset;
+	static int started;
+	snd_seq_real_time_t rt;
+	long long now, when;
+
+	now = queuetime();
+	if (!started) {
+		offset = now + lookahead * 1000 - (long long)t;
+		started = 1;
+	}
+	when = (long long)t + offset;
+	if (when < now) {
+		++nlate;
+		if (now - when > maxlate)
+			maxlate = now - when;
+		if (vflag)
+			fprintf(stderr, "event at %lld.%09lld late by %lld us\n", when / 1000000000, when % 1000000000, (now - when) / 1000);
+		when = now;
+	}
+	rt.tv_sec = when / 1000000000;
+	rt.tv_nsec = when % 1000000000;
+	snd_seq_ev_schedule_real(evt, queue, 0, &rt);
+}
+
+/*
+Schedules evt no earlier than the time at which the previous messages
+have been transmitted at the rate given by -R, plus the gap given by
+-g after a system exclusive message.
+*/
+static void
+paceevent(struct input *in, snd_seq_event_t *evt)
+{
+	snd_seq_real_time_t rt;
+	const unsigned char *data;
+	long long t;
+	size_t len;
+	int eox;
+
+	if (snd_seq_ev_is_variable(evt)) {
+		data = evt->data.ext.ptr;
+		len = evt->data.ext.len;
+		eox = len > 0 && data[len - 1] == 0xF7;
+	} else {
+		len = miditab[seqtypestatus[evt->type]] & MIDI_LEN;
+		eox = 0;
+	}
+	t = queuetime();
+	if (tflag)
+		t = evt->time.time.tv_sec * 1000000000ll + evt->time.time.tv_nsec;
+	if (t < in->next)
+		t = in->next;
+	in->next = t;
+	if (pacerate > 0)
+		in->next += len * 1000000000ll / pacerate;
+	if (eox)
+		in->next += sysexgap * 1000;
+	rt.tv_sec = t / 1000000000;
+	rt.tv_nsec = t % 1000000000;
+	snd_seq_ev_schedule_real(evt, queue, 0, &rt);
+}
+
+static void
+inputevent(void *arg, snd_seq_event_t *evt)
+{
+	if (pacerate > 0 || sysexgap > 0)
+		paceevent(arg, evt);
+	outputevent(evt);
+}
+
+/*
+Writes out the held back input once the coalescing window expires.
+Returns the time until then in milliseconds, or -1 if there is none.
+*/
+static int
+expireinput(struct input *in)
+{
+	long long t;
+
+	if (!in->co || in->co->n == 0)
+		return -1;
+	t = in->co->deadline - monotime();
+	if (t < 1000000) {
+		flushcoalesce(in->co, inputevent, in);
+		return -1;
+	}
+	return t / 1000000;
+}
+
+/* writes msg to the sequencer, splitting system exclusive messages into chunks */
+static void
+outputmsg(struct input *in, const struct midimsg *msg)
+{
+	struct midimsg m;
+	size_t rem;
+
+	m = *msg;
+	rem = msg->len;
+	do {
+		if (m.flags & MIDIMSG_SYSEX && sysexchunk > 0 && rem > sysexchunk) {
+			m.len = sysexchunk;
+			m.flags &= ~MIDIMSG_EOX;
+		} else {
+			m.len = rem;
+			m.flags = msg->flags;
+		}
+		if (!seqencode(&in->evt, &m)) {
+			statadd(&stats->errors, 1);
+			break;
+		}
+		if (in->co) {
+			if (coalesce(in->co, &in->evt))
+				break;  /* never split */
+			if (in->co->n > 0 && !isrealtime(&in->evt))
+				flushcoalesce(in->co, inputevent, in);
+		}
+		inputevent(in, &in->evt);
+		m.data += m.len;
+		rem -= m.len;
+	} while (rem > 0);
+}
+
+static int
+inputfiltered(struct input *in, const struct midimsg *m)
+{
+	if (m->flags & MIDIMSG_SYSEX) {
+		/* later chunks follow the first */
+		if (m->data[0] == 0xF0)
+			in->dropsysex = midifiltered(&filter, m->data);
+		return in->dropsysex;
+	}
+	return midifiltered(&filter, m->data);
+}
+
+/* parses MIDI (or frames in -t mode) read from rfd into sequencer events */
+static void
+encodeinput(struct port *p, const unsigned char *pos, size_t len)
+{
+	struct input *in;
+	struct midimsg msg;
+	size_t n, ret;
+
+	in = &p->in;
+	while (len > 0) {
+		n = len;
+		if (tflag) {
+			if (in->hdrpos < FRAMEHDR) {
+				n = FRAMEHDR - in->hdrpos < len ? FRAMEHDR - in->hdrpos : len;
+				memcpy(in->hdr + in->hdrpos, pos, n);
+				in->hdrpos += n;
+				pos += n;
+				len -= n;
+				if (in->hdrpos == FRAMEHDR) {
+					scheduleevent(&in->evt, getle64(in->hdr));
+					in->framelen = getle16(in->hdr + 10);
+					if (in->framelen == 0)
+						in->hdrpos = 0;
+				}
+				continue;
+			}
+			if (n > in->framelen)
+				n = in->framelen;
+		}
+		ret = midiparse(&in->parser, pos, n, &msg);
+		pos += ret;
+		len -= ret;
+		if (tflag && (in->framelen -= ret) == 0)
+			in->hdrpos = 0;
+		if (msg.len > 0 && !(fflag && inputfiltered(in, &msg)))
+			outputmsg(in, &msg);
+	}
+}
+
+/*
+Writes the UMP packets in a stream of big-endian words read from rfd
+to the sequencer. The packet size is given by the message type in the
+first word, so only packets split across reads need to be buffered.
+*/
+static void
+encodeump(struct port *p, const unsigned char *pos, size_t len)
+{
+	struct input *in;
+	const unsigned char *data;
+	size_t n, i;
+
+	in = &p->in;
+	while (len > 0) {
+		if (in->umppos == 0 && len >= umpwords[pos[0] >> 4] * 4) {
+			data = pos;
+			n = umpwords[pos[0] >> 4];
+			pos += n * 4;
+			len -= n * 4;
+		} else {
+			n = (in->umppos < 4 ? 4 : umpwords[in->ump[0] >> 4] * 4) - in->umppos;
+			if (n > len)
+				n = len;
+			memcpy(in->ump + in->umppos, pos, n);
+			in->umppos += n;
+			pos += n;
+			len -= n;
+			n = umpwords[in->ump[0] >> 4];
+			if (in->umppos < 4 || in->umppos < n * 4)
+				continue;
+			data = in->ump;
+			in->umppos = 0;
+		}
+		for (i = 0; i < n; ++i)
+			in->uevt.ump[i] = getbe32(data + i * 4);
+		outputump(&in->uevt);
+	}
+}
+
+static void
+inputreader(struct port *p)
+{
+	struct pollfd pfd;
+	ssize_t ret;
+	long long deadline, t;
+	int timeout;
+	unsigned char buf[1024];
+
+	newstats("write");
+	setsched(XWRITE);
+	pfd.fd = p->fd[0];
+	pfd.events = POLLIN;
+	deadline = 0;
+	for (;;) {
+		timeout = expireinput(&p->in);
+		if (outbatch > 0) {
+			/* wait for more input until the latency limit, rounded up to whole milliseconds */
+			t = (deadline - monotime() + 999999) / 1000000;
+			if (t <= 0) {
+				drainoutput();
+				continue;
+			}
+			if (timeout == -1 || t < timeout)
+				timeout = t;
+		}
+		if (p->ring[0]) {
+			if (timeout != -1 && !shmringwait(p->ring[0], SHMRINGREAD, timeout))
+				continue;
+			ret = shmringread(p->ring[0], buf, sizeof buf);
+		} else {
+			if (timeout != -1 && poll(&pfd, 1, timeout) == 0)
+				continue;
+			ret = read(pfd.fd, buf, sizeof buf);
+			if (ret < 0) {
+				perror("read");
+				exit(1);
+			}
+		}
+		if (ret == 0)
+			break;
+		statadd(&stats->wbytes, ret);
+		if (outbatch == 0 && outlatency > 0)
+			deadline = monotime() + outlatency * 1000;
+		if (uflag)
+			encodeump(p, buf, ret);
+		else
+			encodeinput(p, buf, ret);
+		if (outbatch > 0 && outlatency == 0)
+			drainoutput();
+	}
+	if (p->in.co)
+		flushcoalesce(p->in.co, inputevent, &p->in);
+	if (outbatch > 0)
+		drainoutput();
+	if (queue != -1) {
+		/* wait for scheduled events to be delivered before exiting */
+		ret = snd_seq_sync_output_queue(seq);
+		if (ret < 0)
+			fatal("snd_seq_sync_output_queue: %s", snd_strerror(ret));
+	}
+}
+
+static void
+setnonblock(int fd)
+{
+	int flags;
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0)
+		fatal("fcntl O_NONBLOCK:");
+}
+
+struct watch {
+	int fd;
+	unsigned mask, events;
+};
+
+/* updates the epoll interest set of w, removing it while there is none */
+static void
+setwatch(int ep, struct watch *w, unsigned events)
+{
+	struct epoll_event ev;
+	int op;
+
+	events &= w->mask;
+	if (events == w->events)
+		return;
+	ev.events = events;
+	ev.data.ptr = w;
+	op = !events ? EPOLL_CTL_DEL : !w->events ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+	if (epoll_ctl(ep, op, w->fd, &ev) != 0)
+		fatal("epoll_ctl:");
+	w->events = events;
+}
+
+static void
+initwatch(struct watch *w, int fd, unsigned mask)
+{
+	w->fd = fd;
+	w->mask = mask;
+	w->events = 0;
+}
+
+/*
+Runs both directions on a single thread, with the sequencer and the
+file descriptors in non-blocking mode.
+*/
+static void
+eventloop(struct port *p)
+{
+	struct epoll_event evs[8];
+	struct watch w[6], *rw, *ww, *sw;
+	struct pollfd pfd[4];
+	snd_seq_event_t *evt, *pend;
+	size_t ostart, oend, room;
+	ssize_t ret;
+	long long deadline, now;
+	int ep, i, n, npfd, nw, timeout, rdy, seqblocked, wblocked;
+	int rfd, wfd, mode;
+	unsigned char ibuf[4096], obuf[65536];
+
+	newstats("loop");
+	setsched(XREAD);
+	rfd = p->fd[0];
+	wfd = p->fd[1];
+	mode = p->mode;
+	ep = epoll_create1(EPOLL_CLOEXEC);
+	if (ep < 0)
+		fatal("epoll_create1:");
+	ret = snd_seq_nonblock(seq, 1);
+	if (ret)
+		fatal("snd_seq_nonblock: %s", snd_strerror(ret));
+	npfd = snd_seq_poll_descriptors(seq, pfd, LEN(pfd), POLLIN | POLLOUT);
+	if (npfd <= 0)
+		fatal("snd_seq_poll_descriptors failed");
+	for (nw = 0; nw < npfd; ++nw)
+		initwatch(&w[nw], pfd[nw].fd, pfd[nw].events & (POLLIN | POLLOUT));
+	rw = NULL;
+	ww = NULL;
+	if (mode & WRITE) {
+		setnonblock(rfd);
+		rw = &w[nw++];
+		initwatch(rw, rfd, EPOLLIN);
+	}
+	if (mode & READ) {
+		setnonblock(wfd);
+		if (rw && wfd == rfd) {
+			ww = rw;
+			ww->mask |= EPOLLOUT;
+		} else {
+			ww = &w[nw++];
+			initwatch(ww, wfd, EPOLLOUT);
+		}
+	}
+
+	pend = NULL;
+	ostart = oend = 0;
+	deadline = 0;
+	seqblocked = 0;
+	wblocked = 0;
+	for (;;) {
+		/* sequencer to wfd */
+		if (mode & READ) {
+			for (;;) {
+				if (ostart != oend && !wblocked) {
+					ret = write(wfd, obuf + ostart, oend - ostart);
+					if (ret < 0) {
+						if (errno != EAGAIN)
+							fatal("write:");
+						wblocked = 1;
+					} else {
+						statadd(&stats->rbytes, ret);
+						ostart += ret;
+					}
+				}
+				if (ostart == oend)
+					ostart = oend = 0;
+				if (pend) {
+					evt = pend;
+				} else {
+					ret = snd_seq_event_input(seq, &evt);
+					if (ret == -EAGAIN)
+						break;
+					if (ret == -ENOSPC) {
+						fprintf(stderr, "snd_seq_event_input: %s\n", snd_strerror(ret));
+						statadd(&stats->overruns, 1);
+						continue;
+					}
+					if (ret < 0)
+						fatal("snd_seq_event_input: %s", snd_strerror(ret));
+					if (fflag && eventfiltered(evt))
+						continue;
+				}
+				ret = decodeevent(p, obuf + oend, obuf + sizeof obuf, evt);
+				if (ret == -ENOMEM && oend > 0) {
+					/* wait for wfd to drain */
+					pend = evt;
+					if (wblocked)
+						break;
+					continue;
+				}
+				pend = NULL;
+				if (ret == -ENOENT)
+					continue;  /* not a midi message */
+				if (ret < 0)
+					fatal("snd_midi_event_decode: %s", snd_strerror(ret));
+				statadd(&stats->revents, 1);
+				oend += ret;
+			}
+		}
+
+		/* rfd to sequencer */
+		if (mode & WRITE) {
+			if (seqblocked || (outbatch > 0 && outlatency > 0 && monotime() >= deadline))
+				seqblocked = trydrain();
+			/* only read as much as fits in the output buffer */
+			room = snd_seq_get_output_buffer_size(seq) - snd_seq_event_output_pending(seq);
+			room /= sizeof(snd_seq_event_t) + 1;
+			if (room > sizeof ibuf)
+				room = sizeof ibuf;
+			if (room == 0 && !seqblocked)
+				seqblocked = trydrain();
+			if (!seqblocked && room > 0) {
+				ret = read(rfd, ibuf, room);
+				if (ret < 0 && errno != EAGAIN)
+					fatal("read:");
+				if (ret == 0)
+					break;
+				if (ret > 0) {
+					statadd(&stats->wbytes, ret);
+					if (outbatch == 0 && outlatency > 0)
+						deadline = monotime() + outlatency * 1000;
+					encodeinput(p, ibuf, ret);
+					if (outbatch > 0 && outlatency == 0)
+						seqblocked = trydrain();
+				}
+			}
+		}
+
+		for (i = 0; i < npfd; ++i) {
+			sw = &w[i];
+			setwatch(ep, sw, ((mode & READ) && !pend ? EPOLLIN : 0) | (seqblocked ? EPOLLOUT : 0));
+		}
+		if (rw)
+			setwatch(ep, rw, (!seqblocked ? EPOLLIN : 0) | (ww == rw && wblocked ? EPOLLOUT : 0));
+		if (ww && ww != rw)
+			setwatch(ep, ww, wblocked ? EPOLLOUT : 0);
+		timeout = -1;
+		if (outbatch > 0 && outlatency > 0 && !seqblocked) {
+			now = monotime();
+			timeout = now < deadline ? (deadline - now + 999999) / 1000000 : 0;
+		}
+		n = epoll_wait(ep, evs, LEN(evs), timeout);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			fatal("epoll_wait:");
+		}
+		for (i = 0; i < n; ++i) {
+			rdy = evs[i].events;
+			if (evs[i].data.ptr == ww && rdy & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+				wblocked = 0;
+		}
+	}
+	/* rfd reached EOF */
+	while (trydrain()) {
+		for (i = 0; i < npfd; ++i)
+			pfd[i].events = POLLOUT;
+		poll(pfd, npfd, -1);
+	}
+	if (queue != -1) {
+		/* wait for scheduled events to be delivered before exiting */
+		ret = snd_seq_sync_output_queue(seq);
+		if (ret < 0)
+			fatal("snd_seq_sync_output_queue: %s", snd_strerror(ret));
+	}
+}
+
+/* closes the pipes of the client of a port in -D mode, with fdlock held */
+static void
+detach(struct port *p)
+{
+	if (p->fd[0] >= 0) {
+		if (epoll_ctl(p->worker->ep, EPOLL_CTL_DEL, p->fd[0], NULL) != 0)
+			fatal("epoll_ctl:");
+		close(p->fd[0]);
+	}
+	if (p->fd[1] >= 0)
+		close(p->fd[1]);
+	p->fd[0] = p->fd[1] = -1;
+	atomic_store(&p->attached, 0);
+}
+
+/*
+In -D mode, output for a port without a client is discarded. The pipe
+of a client is non-blocking, so that one that does not read cannot
+stall the worker, and a write of at most PIPE_BUF bytes takes all of
+buf or none. Returns 0 if the pipe is full.
+*/
+static int
+writeport(struct port *p, const unsigned char *buf, size_t len)
+{
+	ssize_t ret;
+	int full;
+
+	if (!daemonpath) {
+		statadd(&stats->rbytes, len);
+		writefull(p->fd[1], buf, len);
+		return 1;
+	}
+	full = 0;
+	pthread_mutex_lock(&p->fdlock);
+	if (p->fd[1] >= 0) {
+		ret = write(p->fd[1], buf, len);
+		if (ret > 0)
+			statadd(&stats->rbytes, ret);
+		else if (errno == EAGAIN)
+			full = 1;
+		else if (errno != EPIPE)  /* detached on the next request */
+			fatal("write:");
+	}
+	pthread_mutex_unlock(&p->fdlock);
+	return !full;
+}
+
+/* copies the messages queued for a port to its wfd */
+static int
+flushport(struct port *p)
+{
+	size_t len, ret;
+	unsigned long n;
+	unsigned char buf[PIPE_BUF];
+
+	len = 0;
+	for (n = 0; sizeof buf - len >= RINGDATA; ++n) {
+		ret = dequeue(p, buf + len);
+		if (ret == 0)
+			break;
+		len += ret;
+	}
+	if (len > 0 && !writeport(p, buf, len)) {
+		/* the client starts over with the next whole message */
+		p->q->unread += n;
+		p->skipsysex = p->insysex;
+		p->runstatus = 0;
+	}
+	return len > 0;
+}
+
+/*
+Services the file descriptors of a subset of the ports in multi-port
+mode. Sequencer events are dispatched to the port queues by midireader,
+which wakes the worker through its eventfd.
+*/
+static void *
+worker(void *arg)
+{
+	struct worker *w;
+	struct port *p;
+	struct epoll_event evs[16];
+	cpu_set_t cpus;
+	size_t i;
+	ssize_t ret;
+	uint64_t cnt;
+	unsigned client;
+	int busy, err, j, n, t, timeout;
+	char name[16];
+	unsigned char buf[1024];
+
+	w = arg;
+	snprintf(name, sizeof name, "worker%d", w->id);
+	newstats(name);
+	/* after setsched, which may pin to the whole -x set */
+	setsched(XWORKER);
+	if (w->cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(w->cpu, &cpus);
+		err = pthread_setaffinity_np(pthread_self(), sizeof cpus, &cpus);
+		if (err)
+			fprintf(stderr, "pthread_setaffinity_np: %s\n", strerror(err));
+	}
+	for (;;) {
+		busy = 0;
+		for (i = 0; i < w->nports; ++i) {
+			p = w->ports[i];
+			if (p->q && flushport(p))
+				busy = 1;
+		}
+		if (!busy) {
+			for (i = 0; i < w->nports; ++i) {
+				p = w->ports[i];
+				if (p->q && !ringidle(&p->q->ring))
+					busy = 1;
+			}
+		}
+		timeout = -1;
+		if (cowindow > 0) {
+			pthread_mutex_lock(&outlock);
+			for (i = 0; i < w->nports; ++i) {
+				t = expireinput(&w->ports[i]->in);
+				if (t != -1 && (timeout == -1 || t < timeout))
+					timeout = t;
+			}
+			if (outbatch > 0)
+				drainoutput();
+			pthread_mutex_unlock(&outlock);
+		}
+		n = epoll_wait(w->ep, evs, LEN(evs), busy ? 0 : timeout);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			fatal("epoll_wait:");
+		}
+		for (j = 0; j < n; ++j) {
+			p = evs[j].data.ptr;
+			if (!p) {
+				if (read(w->wakefd, &cnt, sizeof cnt) < 0 && errno != EAGAIN)
+					fatal("read:");
+				continue;
+			}
+			client = p->inclient;
+			if (daemonpath) {
+				pthread_mutex_lock(&p->fdlock);
+				client = p->client;
+				ret = p->fd[0] >= 0 ? read(p->fd[0], buf, sizeof buf) : -1;
+				if (ret == 0)
+					detach(p);
+				pthread_mutex_unlock(&p->fdlock);
+				if (ret <= 0)
+					continue;
+			} else {
+				ret = read(p->fd[0], buf, sizeof buf);
+			}
+			if (ret < 0) {
+				if (errno == EAGAIN)
+					continue;
+				fatal("read:");
+			}
+			if (ret == 0) {
+				if (epoll_ctl(w->ep, EPOLL_CTL_DEL, p->fd[0], NULL) != 0)
+					fatal("epoll_ctl:");
+				continue;
+			}
+			statadd(&stats->wbytes, ret);
+			pthread_mutex_lock(&outlock);
+			if (client != p->inclient) {
+				memset(&p->in.parser, 0, sizeof p->in.parser);
+				p->inclient = client;
+			}
+			encodeinput(p, buf, ret);
+			if (outbatch > 0)
+				drainoutput();
+			pthread_mutex_unlock(&outlock);
+		}
+	}
+	return NULL;
+}
+
+static void
+startworkers(size_t nworkers)
+{
+	struct worker *workers, *w;
+	struct epoll_event ev;
+	struct port *p;
+	cpu_set_t cpus;
+	size_t i;
+	int cpu, err, ncpu, n;
+
+	workers = calloc(nworkers, sizeof *workers);
+	if (!workers)
+		fatal("calloc:");
+	/* spread the workers over the CPUs they may run on */
+	if (xsched[XWORKER].set && xsched[XWORKER].pin)
+		cpus = xsched[XWORKER].cpus;
+	else if (sched_getaffinity(0, sizeof cpus, &cpus) != 0)
+		CPU_ZERO(&cpus);
+	ncpu = CPU_COUNT(&cpus);
+	for (i = 0; i < nworkers; ++i) {
+		w = &workers[i];
+		w->id = i;
+		w->cpu = -1;
+		if (ncpu > 1) {
+			n = i % ncpu;
+			for (cpu = 0; !CPU_ISSET(cpu, &cpus) || n-- > 0; ++cpu)
+				;
+			w->cpu = cpu;
+		}
+		w->ports = calloc(nports / nworkers + 1, sizeof *w->ports);
+		if (!w->ports)
+			fatal("calloc:");
+		w->ep = epoll_create1(EPOLL_CLOEXEC);
+		if (w->ep < 0)
+			fatal("epoll_create1:");
+		w->wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (w->wakefd < 0)
+			fatal("eventfd:");
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if (epoll_ctl(w->ep, EPOLL_CTL_ADD, w->wakefd, &ev) != 0)
+			fatal("epoll_ctl:");
+	}
+	for (i = 0; i < nports; ++i) {
+		p = &ports[i];
+		w = &workers[i % nworkers];
+		w->ports[w->nports++] = p;
+		p->worker = w;
+		if (p->q)
+			p->q->ring.wakefd = w->wakefd;
+		if (p->mode & WRITE && p->fd[0] >= 0) {
+			setnonblock(p->fd[0]);
+			ev.events = EPOLLIN;
+			ev.data.ptr = p;
+			if (epoll_ctl(w->ep, EPOLL_CTL_ADD, p->fd[0], &ev) != 0)
+				fatal("epoll_ctl:");
+		}
+	}
+	for (i = 0; i < nworkers; ++i) {
+		err = pthread_create(&workers[i].thread, NULL, worker, &workers[i]);
+		if (err)
+			fatal("pthread_create: %s", strerror(err));
+	}
+}
+
+/* whether the client of a port has closed its ends of the pipes */
+static int
+clientgone(struct port *p)
+{
+	struct pollfd pfd;
+
+	pfd.events = 0;
+	if (p->fd[0] >= 0) {
+		/* keep a client whose last messages are still unread */
+		pfd.fd = p->fd[0];
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 0) > 0 && pfd.revents & POLLHUP && !(pfd.revents & POLLIN))
+			return 1;
+	}
+	if (p->fd[1] >= 0) {
+		pfd.fd = p->fd[1];
+		pfd.events = 0;
+		if (poll(&pfd, 1, 0) > 0 && pfd.revents & POLLERR)
+			return 1;
+	}
+	return 0;
+}
+
+/* creates the pipes of a new client, returning its ends, or -1 if the port is busy */
+static int
+attach(struct port *p, int cfd[static 2])
+{
+	int in[2], out[2];
+	struct epoll_event ev;
+
+	pthread_mutex_lock(&p->fdlock);
+	if (atomic_load(&p->attached)) {
+		if (!clientgone(p)) {
+			pthread_mutex_unlock(&p->fdlock);
+			return -1;
+		}
+		detach(p);
+	}
+	cfd[0] = cfd[1] = -1;
+	if (p->mode & WRITE) {
+		if (pipe2(in, O_CLOEXEC) != 0)
+			fatal("pipe2:");
+		setnonblock(in[0]);
+		/* the worker resets the parser when it reads from the new client */
+		++p->client;
+		p->fd[0] = in[0];
+		cfd[1] = in[1];
+		ev.events = EPOLLIN;
+		ev.data.ptr = p;
+		if (epoll_ctl(p->worker->ep, EPOLL_CTL_ADD, p->fd[0], &ev) != 0)
+			fatal("epoll_ctl:");
+	}
+	if (p->mode & READ) {
+		if (pipe2(out, O_CLOEXEC) != 0)
+			fatal("pipe2:");
+		setnonblock(out[1]);
+		atomic_store(&p->newstatus, 1);
+		p->fd[1] = out[1];
+		cfd[0] = out[0];
+	}
+	atomic_store(&p->attached, 1);
+	pthread_mutex_unlock(&p->fdlock);
+	return 0;
+}
+
+/* sends a reply line, with the descriptors that are not -1 */
+static void
+sendreply(int sock, const char *reply, const int fd[static 2])
+{
+	struct msghdr msg = {0};
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+	} ctl;
+	int n;
+
+	iov.iov_base = (char *)reply;
+	iov.iov_len = strlen(reply);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	n = (fd[0] >= 0) + (fd[1] >= 0);
+	if (n > 0) {
+		msg.msg_control = ctl.buf;
+		msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+		n = 0;
+		if (fd[0] >= 0)
+			memcpy(CMSG_DATA(cmsg) + n++ * sizeof(int), &fd[0], sizeof(int));
+		if (fd[1] >= 0)
+			memcpy(CMSG_DATA(cmsg) + n * sizeof(int), &fd[1], sizeof(int));
+	}
+	if (sendmsg(sock, &msg, MSG_NOSIGNAL) < 0)
+		fprintf(stderr, "sendmsg: %s\n", strerror(errno));
+}
+
+static int
+listenunix(const char *path, int type)
+{
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	int sock;
+
+	if (strlen(path) >= sizeof addr.sun_path)
+		fatal("socket path is too long");
+	strcpy(addr.sun_path, path);
+	sock = socket(AF_UNIX, type | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		fatal("socket:");
+	unlink(path);
+	if (bind(sock, (struct sockaddr *)&addr, sizeof addr) != 0)
+		fatal("bind %s:", path);
+	if (listen(sock, 64) != 0)
+		fatal("listen:");
+	return sock;
+}
+
+/*
+Hands out pipes to the ports in -D mode. A client sends the target of
+a port as it was given with -p, and the reply is 'ok' followed by the
+directions of the pipe ends that come with it, 'r' for reading MIDI
+from the port and 'w' for writing to it, or 'error' and a message.
+A port has one client at a time, until it closes its ends.
+*/
+static void *
+daemonloop(void *arg)
+{
+	struct port *p;
+	struct timeval tv;
+	char req[256], reply[64];
+	ssize_t len;
+	size_t i;
+	int sock, conn, fd[2];
+
+	sock = *(int *)arg;
+	for (;;) {
+		conn = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+		if (conn < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			fatal("accept4:");
+		}
+		/* a client that does not send its request does not hold up the others for long */
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+		setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+		fd[0] = fd[1] = -1;
+		len = recv(conn, req, sizeof req - 1, 0);
+		if (len <= 0)
+			goto done;
+		req[len] = '\0';
+		req[strcspn(req, "\n")] = '\0';
+		for (i = 0; i < nports && strcmp(ports[i].target, req) != 0; ++i)
+			;
+		if (i == nports) {
+			sendreply(conn, "error no such port\n", fd);
+			goto done;
+		}
+		p = &ports[i];
+		if (attach(p, fd) != 0) {
+			sendreply(conn, "error port is busy\n", fd);
+			goto done;
+		}
+		snprintf(reply, sizeof reply, "ok %s%s\n", fd[0] >= 0 ? "r" : "", fd[1] >= 0 ? "w" : "");
+		sendreply(conn, reply, fd);
+		if (fd[0] >= 0)
+			close(fd[0]);
+		if (fd[1] >= 0)
+			close(fd[1]);
+	done:
+		close(conn);
+	}
+	return NULL;
+}
+
+static void
+printconsumer(const struct consumer *c, unsigned long long head)
+{
+	fprintf(stderr, "tap %d (pid %ld): %llu bytes sent, %llu behind, max %llu, %llu dropped\n",
+		c->id, (long)c->pid, c->sent, head - c->pos + (c->end - c->start), c->maxlag, c->dropped);
+}
+
+static void
+addconsumer(int ep, int fd)
+{
+	struct consumer *c;
+	struct epoll_event ev;
+	struct ucred cred;
+	socklen_t len;
+
+	c = calloc(1, sizeof *c);
+	if (!c)
+		fatal("calloc:");
+	c->fd = fd;
+	len = sizeof cred;
+	c->pid = getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 ? cred.pid : -1;
+	/* only hangups until its socket fills up */
+	ev.events = 0;
+	ev.data.ptr = c;
+	if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) != 0)
+		fatal("epoll_ctl:");
+	pthread_mutex_lock(&tap.lock);
+	c->id = ++tap.nconsumers;
+	c->pos = tap.head;
+	c->next = tap.consumers;
+	tap.consumers = c;
+	pthread_mutex_unlock(&tap.lock);
+}
+
+static void
+removeconsumer(struct consumer *c)
+{
+	struct consumer **cp;
+
+	pthread_mutex_lock(&tap.lock);
+	for (cp = &tap.consumers; *cp != c; cp = &(*cp)->next)
+		;
+	*cp = c->next;
+	if (vflag)
+		printconsumer(c, tap.head);
+	pthread_mutex_unlock(&tap.lock);
+	close(c->fd);
+	free(c);
+}
+
+/* returns the index of the first write kept at or after pos */
+static unsigned long long
+findmark(unsigned long long pos)
+{
+	unsigned long long lo, hi, mid;
+
+	lo = tap.nmarks > TAPMARKS ? tap.nmarks - TAPMARKS : 0;
+	hi = tap.nmarks;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (tap.marks[mid & (TAPMARKS - 1)] < pos)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* takes the next whole writes a consumer has not seen, with tap.lock held */
+static int
+takeconsumer(struct consumer *c)
+{
+	unsigned long long lag, i, pos;
+	size_t off, n;
+
+	lag = tap.head - c->pos;
+	if (lag > c->maxlag)
+		c->maxlag = lag;
+	if (lag > TAPSIZE) {
+		/* a frame cut short cannot be told from the next in -t mode */
+		if (c->partial && tflag)
+			return -1;
+		i = findmark(tap.head - TAPSIZE);
+		pos = i < tap.nmarks ? tap.marks[i & (TAPMARKS - 1)] : tap.head;
+		c->dropped += pos - c->pos;
+		c->pos = pos;
+		c->partial = 0;
+	}
+	n = tap.head - c->pos;
+	if (n > sizeof c->buf) {
+		/* the last write that starts within the buffer */
+		i = findmark(c->pos + sizeof c->buf + 1);
+		pos = i > 0 && i + TAPMARKS > tap.nmarks ? tap.marks[(i - 1) & (TAPMARKS - 1)] : 0;
+		c->partial = pos <= c->pos;
+		n = c->partial ? sizeof c->buf : pos - c->pos;
+	} else {
+		c->partial = 0;
+	}
+	off = c->pos & (TAPSIZE - 1);
+	if (n > TAPSIZE - off) {
+		memcpy(c->buf, tap.buf + off, TAPSIZE - off);
+		memcpy(c->buf + (TAPSIZE - off), tap.buf, n - (TAPSIZE - off));
+	} else {
+		memcpy(c->buf, tap.buf + off, n);
+	}
+	c->pos += n;
+	c->start = 0;
+	c->end = n;
+	return n > 0;
+}
+
+/*
+Sends a consumer the next part of the ring it has not seen. Returns 1
+if there may be more to send, 0 once it is caught up or its socket is
+full, or -1 if it has gone away.
+*/
+static int
+sendconsumer(int ep, struct consumer *c)
+{
+	struct epoll_event ev;
+	ssize_t ret;
+
+	if (c->start == c->end) {
+		pthread_mutex_lock(&tap.lock);
+		ret = takeconsumer(c);
+		pthread_mutex_unlock(&tap.lock);
+		if (ret <= 0)
+			return ret;
+	}
+	ret = send(c->fd, c->buf + c->start, c->end - c->start, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (ret < 0) {
+		if (errno != EAGAIN)
+			return -1;
+		c->blocked = 1;
+		ev.events = EPOLLOUT;
+		ev.data.ptr = c;
+		if (epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev) != 0)
+			fatal("epoll_ctl:");
+		return 0;
+	}
+	c->start += ret;
+	c->sent += ret;
+	return 1;
+}
+
+/*
+Serves the consumers of -T mode. Each is sent the messages read from
+the port since it connected, as fast as it reads them. Those that are
+blocked are left alone until their socket has room again.
+*/
+static void *
+taploop(void *arg)
+{
+	struct epoll_event ev, evs[16];
+	struct consumer *c, *next;
+	uint64_t cnt;
+	int ep, sock, fd, i, n, idle, ret;
+
+	sock = *(int *)arg;
+	ep = epoll_create1(EPOLL_CLOEXEC);
+	if (ep < 0)
+		fatal("epoll_create1:");
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(ep, EPOLL_CTL_ADD, sock, &ev) != 0)
+		fatal("epoll_ctl:");
+	ev.data.ptr = &tap;
+	if (epoll_ctl(ep, EPOLL_CTL_ADD, tap.wakefd, &ev) != 0)
+		fatal("epoll_ctl:");
+	for (;;) {
+		idle = 1;
+		for (c = tap.consumers; c; c = next) {
+			next = c->next;
+			if (c->blocked)
+				continue;
+			ret = c->gone ? -1 : 1;
+			while (ret > 0)
+				ret = sendconsumer(ep, c);
+			if (ret < 0)
+				removeconsumer(c);
+		}
+		/* sleep until the reader adds to the ring, unless it already has */
+		pthread_mutex_lock(&tap.lock);
+		for (c = tap.consumers; c; c = c->next) {
+			if (!c->blocked && c->pos != tap.head)
+				idle = 0;
+		}
+		tap.waiting = idle;
+		pthread_mutex_unlock(&tap.lock);
+		n = epoll_wait(ep, evs, LEN(evs), idle ? -1 : 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			fatal("epoll_wait:");
+		}
+		for (i = 0; i < n; ++i) {
+			if (!evs[i].data.ptr) {
+				fd = accept4(sock, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+				if (fd >= 0)
+					addconsumer(ep, fd);
+				else if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN)
+					fatal("accept4:");
+			} else if (evs[i].data.ptr == &tap) {
+				if (read(tap.wakefd, &cnt, sizeof cnt) < 0 && errno != EAGAIN)
+					fatal("read:");
+			} else {
+				c = evs[i].data.ptr;
+				if (evs[i].events & (EPOLLHUP | EPOLLERR))
+					c->gone = 1;
+				c->blocked = 0;
+				ev.events = 0;
+				ev.data.ptr = c;
+				if (epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev) != 0)
+					fatal("epoll_ctl:");
+			}
+		}
+	}
+	return NULL;
+}
+
+static void
+starttap(const char *path)
+{
+	pthread_t thread;
+	static int sock;
+	int err;
+
+	tap.buf = malloc(TAPSIZE);
+	tap.marks = malloc(TAPMARKS * sizeof *tap.marks);
+	if (!tap.buf || !tap.marks)
+		fatal("malloc:");
+	tap.wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (tap.wakefd < 0)
+		fatal("eventfd:");
+	sock = listenunix(path, SOCK_STREAM);
+	err = pthread_create(&thread, NULL, taploop, &sock);
+	if (err)
+		fatal("pthread_create: %s", strerror(err));
+}
+
+/*
+Asks the daemon at path for the pipes of a port, and runs the command
+with them at the descriptors given by -f, without opening the
+sequencer.
+*/
+static void
+runattached(const char *path, const char *target, const int fd[static 2], char *argv[])
+{
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	struct msghdr msg = {0};
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+	} ctl;
+	char reply[256];
+	const char *dir;
+	ssize_t len;
+	int sock, got[2], n, i;
+
+	if (strlen(path) >= sizeof addr.sun_path)
+		fatal("socket path is too long");
+	strcpy(addr.sun_path, path);
+	sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		fatal("socket:");
+	if (connect(sock, (struct sockaddr *)&addr, sizeof addr) != 0)
+		fatal("connect %s:", path);
+	if (send(sock, target, strlen(target), MSG_NOSIGNAL) < 0)
+		fatal("send:");
+	iov.iov_base = reply;
+	iov.iov_len = sizeof reply - 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof ctl.buf;
+	len = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	if (len < 0)
+		fatal("recvmsg:");
+	close(sock);
+	reply[len] = '\0';
+	reply[strcspn(reply, "\n")] = '\0';
+	if (strncmp(reply, "ok ", 3) != 0)
+		fatal("%s: %s", target, strncmp(reply, "error ", 6) == 0 ? reply + 6 : "invalid reply");
+	n = 0;
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+		n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	dir = reply + 3;
+	if (n != strlen(dir))
+		fatal("%s: invalid reply", target);
+	memcpy(got, CMSG_DATA(cmsg), n * sizeof(int));
+	for (i = 0; i < n; ++i) {
+		/* messages read from the port are read by the command on fd[0] */
+		if (got[i] == fd[dir[i] == 'w'])
+			fcntl(got[i], F_SETFD, 0);
+		else if (dup2(got[i], fd[dir[i] == 'w']) < 0)
+			fatal("dup2:");
+	}
+	execvp(argv[0], argv);
+	fatal("exec %s:", argv[0]);
+}
+
+static void
+closerings(void)
+{
+	struct port *p;
+
+	p = &ports[0];
+	if (p->ring[0])
+		shmringclose(p->ring[0]);
+	if (p->ring[1])
+		shmringclose(p->ring[1]);
+}
+
+/*
+Sets up the rings of -m mode. They are created and shared with the
+command at the -f descriptor numbers, or without a command, the -f
+descriptors are taken to be rings created by our invoker.
+*/
+static void
+openrings(struct port *p, char *argv[])
+{
+	int shared[2];
+	pid_t parent;
+
+	if (argv) {
+		/* messages read from the port are read by the command on fd[0] */
+		shared[0] = shared[1] = -1;
+		if (p->mode & READ && !(p->ring[1] = shmringcreate(SHMRINGSIZE, &shared[0])))
+			fatal("memfd_create:");
+		if (p->mode & WRITE && !(p->ring[0] = shmringcreate(SHMRINGSIZE, &shared[1])))
+			fatal("memfd_create:");
+		parent = getpid();
+		spawnshared(argv, shared, p->fd);
+		/* a command that dies cannot close its rings, so go with it */
+		if (prctl(PR_SET_PDEATHSIG, SIGTERM) != 0)
+			fatal("prctl PR_SET_PDEATHSIG:");
+		if (getppid() != parent)
+			exit(1);
+		/* and the command notices if alsaseqio dies */
+		if (p->ring[1])
+			shmringown(p->ring[1], SHMRINGREAD, parent);
+		if (p->ring[0])
+			shmringown(p->ring[0], SHMRINGWRITE, parent);
+		if (shared[0] != -1)
+			close(shared[0]);
+		if (shared[1] != -1)
+			close(shared[1]);
+	} else {
+		if (p->mode & WRITE && !(p->ring[0] = shmringmap(p->fd[0])))
+			fatal("shmring %d:", p->fd[0]);
+		if (p->mode & READ && !(p->ring[1] = shmringmap(p->fd[1])))
+			fatal("shmring %d:", p->fd[1]);
+	}
+	if (p->ring[1])
+		shmringown(p->ring[1], SHMRINGWRITE, getpid());
+	if (p->ring[0])
+		shmringown(p->ring[0], SHMRINGREAD, getpid());
+	atexit(closerings);
+}
+
+static unsigned long
+statget(atomic_ulong *c)
+{
+	return atomic_load_explicit(c, memory_order_relaxed);
+}
+
+/* adds up the counters of all threads */
+static void
+sumstats(struct stats *sum)
+{
+	struct stats *s;
+	long long t;
+	size_t i;
+
+	memset(sum, 0, sizeof *sum);
+	snprintf(sum->name, sizeof sum->name, "total");
+	pthread_mutex_lock(&statslock);
+	for (s = allstats; s; s = s->next) {
+		statadd(&sum->revents, statget(&s->revents));
+		statadd(&sum->rbytes, statget(&s->rbytes));
+		statadd(&sum->wevents, statget(&s->wevents));
+		statadd(&sum->wbytes, statget(&s->wbytes));
+		statadd(&sum->drains, statget(&s->drains));
+		statadd(&sum->errors, statget(&s->errors));
+		statadd(&sum->overruns, statget(&s->overruns));
+		statmax(&sum->maxbatch, statget(&s->maxbatch));
+		for (i = 0; i < LEN(s->latency); ++i)
+			statadd(&sum->latency[i], statget(&s->latency[i]));
+		sum->latsum += atomic_load_explicit(&s->latsum, memory_order_relaxed);
+		t = atomic_load_explicit(&s->latmax, memory_order_relaxed);
+		if (t > sum->latmax)
+			sum->latmax = t;
+	}
+	pthread_mutex_unlock(&statslock);
+}
+
+static void
+printstats(FILE *f, struct stats *s, int json)
+{
+	static const char *const names[] = {
+		"read_events", "read_bytes", "write_events", "write_bytes",
+		"drains", "decode_errors", "overruns", "max_batch",
+	};
+	atomic_ulong *c[] = {
+		&s->revents, &s->rbytes, &s->wevents, &s->wbytes,
+		&s->drains, &s->errors, &s->overruns, &s->maxbatch,
+	};
+	long long latsum, latmax;
+	size_t i;
+
+	latsum = atomic_load_explicit(&s->latsum, memory_order_relaxed);
+	latmax = atomic_load_explicit(&s->latmax, memory_order_relaxed);
+	if (json) {
+		fprintf(f, "{\"name\":\"%s\"", s->name);
+		for (i = 0; i < LEN(c); ++i)
+			fprintf(f, ",\"%s\":%lu", names[i], statget(c[i]));
+		fprintf(f, ",\"latency_sum_us\":%lld,\"latency_max_us\":%lld,\"latency_us\":[", latsum / 1000, latmax / 1000);
+		for (i = 0; i < LEN(s->latency); ++i)
+			fprintf(f, "%s%lu", i ? "," : "", statget(&s->latency[i]));
+		fputs("]}", f);
+	} else {
+		fputs(s->name, f);
+		for (i = 0; i < LEN(c); ++i)
+			fprintf(f, " %s=%lu", names[i], statget(c[i]));
+		fprintf(f, " latency_sum_us=%lld latency_max_us=%lld latency_us=", latsum / 1000, latmax / 1000);
+		for (i = 0; i < LEN(s->latency); ++i)
+			fprintf(f, "%s%lu", i ? "," : "", statget(&s->latency[i]));
+		fputc('\n', f);
+	}
+}
+
+/*
+Formats the counters of each thread and their total, as text with one
+line per thread or as a single line of JSON. Returns a buffer to be
+freed by the caller.
+*/
+static char *
+formatstats(int json, size_t *len)
+{
+	struct stats *s, sum;
+	FILE *f;
+	char *buf;
+	long long uptime;
+
+	f = open_memstream(&buf, len);
+	if (!f)
+		fatal("open_memstream:");
+	uptime = (monotime() - starttime) / 1000000;
+	sumstats(&sum);
+	if (json)
+		fprintf(f, "{\"uptime_ms\":%lld,\"threads\":[", uptime);
+	else
+		fprintf(f, "uptime_ms=%lld\n", uptime);
+	pthread_mutex_lock(&statslock);
+	for (s = allstats; s; s = s->next) {
+		printstats(f, s, json);
+		if (json && s->next)
+			fputc(',', f);
+	}
+	pthread_mutex_unlock(&statslock);
+	if (json)
+		fputs("],\"total\":", f);
+	printstats(f, &sum, json);
+	if (json)
+		fputs("}\n", f);
+	if (fclose(f) != 0)
+		fatal("fclose:");
+	return buf;
+}
+
+/* writes the statistics to the -o descriptor */
+static void
+dumpstats(void)
+{
+	char *buf;
+	size_t len;
+
+	buf = formatstats(1, &len);
+	if (write(statsfd, buf, len) < 0)
+		fprintf(stderr, "write: %s\n", strerror(errno));
+	free(buf);
+}
+
+/*
+Answers connections to the -S sockets at once, with the statistics in
+text on one and in JSON on the other, and closes them. A client that
+does not read its answer is given up on after a second.
+*/
+static void *
+statsloop(void *arg)
+{
+	struct timeval tv = {.tv_sec = 1};
+	struct pollfd pfd[2];
+	char *buf;
+	size_t len, off;
+	ssize_t ret;
+	int *sock, fd, i;
+
+	sock = arg;
+	for (i = 0; i < 2; ++i) {
+		pfd[i].fd = sock[i];
+		pfd[i].events = POLLIN;
+	}
+	for (;;) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			fatal("poll:");
+		}
+		for (i = 0; i < 2; ++i) {
+			if (!(pfd[i].revents & POLLIN))
+				continue;
+			fd = accept4(sock[i], NULL, NULL, SOCK_CLOEXEC);
+			if (fd < 0) {
+				if (errno == EINTR || errno == ECONNABORTED)
+					continue;
+				fatal("accept4:");
+			}
+			setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+			buf = formatstats(i == 1, &len);
+			for (off = 0; off < len; off += ret) {
+				ret = send(fd, buf + off, len - off, MSG_NOSIGNAL);
+				if (ret < 0)
+					break;
+			}
+			free(buf);
+			close(fd);
+		}
+	}
+	return NULL;
+}
+
+/* listens for text at path and JSON at path.json */
+static void
+startstats(const char *path)
+{
+	pthread_t thread;
+	static int sock[2];
+	char json[256];
+	int err;
+
+	sock[0] = listenunix(path, SOCK_STREAM);
+	snprintf(json, sizeof json, "%s.json", path);
+	sock[1] = listenunix(json, SOCK_STREAM);
+	err = pthread_create(&thread, NULL, statsloop, sock);
+	if (err)
+		fatal("pthread_create: %s", strerror(err));
+}
+
+static void
+report(void)
+{
+	struct msgq *q;
+	struct coalesce *co;
+	struct consumer *c;
+	struct stats sum;
+	unsigned long rin, rout, win, wout, n;
+	size_t i;
+
+	sumstats(&sum);
+	if (sum.wevents > 0) {
+		fprintf(stderr, "output: %lu events, %lu drains, %.1f events/drain, max %lu\n",
+			(unsigned long)sum.wevents, (unsigned long)sum.drains,
+			sum.drains ? (double)sum.wevents / sum.drains : 0.0, (unsigned long)sum.maxbatch);
+	}
+	for (i = 0; i < nports; ++i) {
+		if (!(q = ports[i].q))
+			continue;
+		if (nports > 1)
+			fprintf(stderr, "%s ", ports[i].target);
+		fprintf(stderr, "queue: %lu queued, %lu blocked, %lu dropped, %lu coalesced",
+			q->queued, q->blocked, q->dropped, q->coalesced);
+		if (daemonpath)
+			fprintf(stderr, ", %lu unread", q->unread);
+		fputc('\n', stderr);
+	}
+	if (sum.overruns > 0)
+		fprintf(stderr, "input: %lu overruns\n", (unsigned long)sum.overruns);
+	if (cowindow > 0) {
+		rin = rout = win = wout = 0;
+		for (i = 0; i < nports; ++i) {
+			if ((co = ports[i].co)) {
+				rin += co->in;
+				rout += co->out;
+			}
+			if ((co = ports[i].in.co)) {
+				win += co->in;
+				wout += co->out;
+			}
+		}
+		fprintf(stderr, "coalesce: read %lu -> %lu events (%.1fx), write %lu -> %lu events (%.1fx)\n",
+			rin, rout, rout ? (double)rin / rout : 0.0, win, wout, wout ? (double)win / wout : 0.0);
+	}
+	if (ndumps > 0) {
+		fprintf(stderr, "sysex: %lu large dumps, %llu bytes, %.0f bytes/s\n",
+			ndumps, dumpbytes, dumptime > 0 ? dumpbytes * 1e9 / dumptime : 0.0);
+	}
+	if (nlate > 0)
+		fprintf(stderr, "schedule: %lu late events, max %lld us\n", nlate, maxlate / 1000);
+	if (nreconnects > 0) {
+		fprintf(stderr, "reconnect: %lu reconnects, %.3f s disconnected, max %lld us after announcement\n",
+			nreconnects, downtime / 1e9, maxreconnect / 1000);
+	}
+	for (i = 0, n = 0; i < LEN(sum.latency); ++i)
+		n += sum.latency[i];
+	if (n > 0) {
+		fprintf(stderr, "wakeup: %lu events, mean %lld us, max %lld us\n",
+			n, (long long)sum.latsum / (long long)n / 1000, (long long)sum.latmax / 1000);
+		for (i = 0; i < LEN(sum.latency); ++i) {
+			if (sum.latency[i] == 0)
+				continue;
+			if (i < LEN(sum.latency) - 1)
+				fprintf(stderr, "wakeup: < %8lu us %10lu\n", 1ul << i, (unsigned long)sum.latency[i]);
+			else
+				fprintf(stderr, "wakeup: >=%8lu us %10lu\n", 1ul << (i - 1), (unsigned long)sum.latency[i]);
+		}
+	}
+	if (tappath) {
+		pthread_mutex_lock(&tap.lock);
+		for (c = tap.consumers; c; c = c->next)
+			printconsumer(c, tap.head);
+		pthread_mutex_unlock(&tap.lock);
+	}
+}
+
+static void *
+sigreader(void *arg)
+{
+	sigset_t *set;
+	int sig;
+
+	set = arg;
+	for (;;) {
+		if (sigwait(set, &sig) != 0)
+			continue;
+		if (sig == SIGUSR2) {
+			dumpstats();
+			continue;
+		}
+		if (vflag)
+			report();
+		if (sig != SIGUSR1) {
+			closerings();
+			_exit(1);
+		}
+	}
+	return NULL;
+}
+
+static long
+parseint(const char *arg)
+{
+	char *end;
+	long n;
+
+	n = strtol(arg, &end, 10);
+	if (end == arg || *end || n < 0)
+		usage();
+	return n;
+}
+
+static int
+parsepolicy(const char *arg)
+{
+	static const char *const names[] = {
+		[QBLOCK] = "block",
+		[QOLDEST] = "oldest",
+		[QREALTIME] = "realtime",
+		[QCOALESCE] = "coalesce",
+	};
+	int i;
+
+	for (i = QBLOCK; i < LEN(names); ++i) {
+		if (strcmp(arg, names[i]) == 0)
+			return i;
+	}
+	usage();
+	return 0;
+}
+
+/*
+Parses a -x argument of the form [thread=]policy[:priority][@cpu[-cpu],...],
+applying to all threads if none is named.
+*/
+static void
+parsesched(char *arg)
+{
+	static const char *const threads[] = {
+		[XREAD] = "read",
+		[XWRITE] = "write",
+		[XQUEUE] = "queue",
+		[XWORKER] = "worker",
+	};
+	struct xsched x = {.set = 1};
+	char *pos, *end;
+	long cpu, last;
+	int i, thread;
+
+	thread = -1;
+	pos = strchr(arg, '=');
+	if (pos) {
+		*pos = '\0';
+		for (thread = 0; thread < LEN(threads) && strcmp(arg, threads[thread]) != 0; ++thread)
+			;
+		if (thread == LEN(threads))
+			usage();
+		arg = pos + 1;
+	}
+	pos = arg + strcspn(arg, ":@");
+	if (pos - arg == 4 && strncmp(arg, "fifo", 4) == 0)
+		x.policy = SCHED_FIFO;
+	else if (pos - arg == 2 && strncmp(arg, "rr", 2) == 0)
+		x.policy = SCHED_RR;
+	else if (pos - arg == 5 && strncmp(arg, "other", 5) == 0)
+		x.policy = SCHED_OTHER;
+	else
+		usage();
+	if (*pos == ':') {
+		x.prio = strtol(pos + 1, &end, 10);
+		if (end == pos + 1)
+			usage();
+		pos = end;
+	}
+	if (x.prio < sched_get_priority_min(x.policy) || x.prio > sched_get_priority_max(x.policy))
+		fatal("-x: priority %d out of range", x.prio);
+	if (*pos == '@') {
+		x.pin = 1;
+		CPU_ZERO(&x.cpus);
+		do {
+			cpu = strtol(pos + 1, &end, 10);
+			if (end == pos + 1 || cpu < 0 || cpu >= CPU_SETSIZE)
+				usage();
+			last = cpu;
+			if (*end == '-') {
+				pos = end;
+				last = strtol(pos + 1, &end, 10);
+				if (end == pos + 1 || last < cpu || last >= CPU_SETSIZE)
+					usage();
+			}
+			for (; cpu <= last; ++cpu)
+				CPU_SET(cpu, &x.cpus);
+			pos = end;
+		} while (*pos == ',');
+	}
+	if (*pos)
+		usage();
+	for (i = 0; i < LEN(xsched); ++i) {
+		if (thread == -1 || thread == i)
+			xsched[i] = x;
+	}
+	xflag = 1;
+}
+
+/* locks all memory, current and future, for -x */
+static void
+lockmemory(void)
+{
+	pthread_attr_t attr;
+	int err;
+
+	/* keep freed memory rather than return it and fault it in again */
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_MAX, 0);
+	/* thread stacks are faulted in whole once locked, so keep them small */
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, 256 * 1024);
+	err = pthread_setattr_default_np(&attr);
+	if (err)
+		fatal("pthread_setattr_default_np: %s", strerror(err));
+	pthread_attr_destroy(&attr);
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+		fatal("mlockall:");
+}
+
+static void
+parseintpair(const char *arg, int num[static 2])
+{
+	char *end;
+	long n;
+
+	num[0] = -1;
+	if (*arg != ',') {
+		n = strtol(arg, &end, 10);
+		if (end == arg || n < 0 || n > INT_MAX)
+			usage();
+		num[0] = (int)n;
+		if (!*end) {
+			num[1] = num[0];
+			return;
+		}
+		if (*end != ',')
+			usage();
+		arg = end + 1;
+	}
+	num[1] = -1;
+	if (*arg) {
+		n = strtol(arg, &end, 10);
+		if (end == arg || *end || n < 0 || n > INT_MAX)
+			usage();
+		num[1] = (int)n;
+	}
+}
+
+/* lets the kernel drop the event types that are filtered on every channel */
+static void
+setkernelfilter(void)
+{
+	int type, status, i, n, err;
+
+	for (type = 0; type < LEN(seqtypestatus); ++type) {
+		status = seqtypestatus[type];
+		if (!status)
+			continue;
+		n = status < 0xF0 ? 16 : 1;
+		for (i = 0; i < n && filter.tab[status + i] & MIDIFILTER_DROP; ++i)
+			;
+		if (i < n) {
+			err = snd_seq_set_client_event_filter(seq, type);
+			if (err)
+				fatal("snd_seq_set_client_event_filter: %s", snd_strerror(err));
+		}
+	}
+}
+
+static struct port *
+addport(const char *target, const int fd[static 2])
+{
+	struct port *p;
 
+	if (nports % 16 == 0) {
+		ports = realloc(ports, (nports + 16) * sizeof *ports);
+		if (!ports)
+			fatal("realloc:");
+	}
+	p = &ports[nports++];
+	memset(p, 0, sizeof *p);
+	p->target = target;
+	p->fd[0] = fd[0];
+	p->fd[1] = fd[1];
+	return p;
+}
+
+/* reads lines of the form 'rfd,wfd client:port' */
 static void
-usage(void)
+readconfig(const char *path)
 {
-	fprintf(stderr, "usage: alsaseqio [-rws] [-f rfd,wfd] [-n name] [-p client:port] [command...]\n"
-	                "       alsaseqio -l\n");
-	exit(1);
+	FILE *f;
+	char *line, *target;
+	size_t size, lineno;
+	ssize_t len;
+	int fd[2], n;
+
+	f = fopen(path, "r");
+	if (!f)
+		fatal("open %s:", path);
+	line = NULL;
+	size = 0;
+	for (lineno = 1; (len = getline(&line, &size, f)) >= 0; ++lineno) {
+		n = 0;
+		sscanf(line, " %n", &n);
+		if (line[n] == '#' || line[n] == '\0')
+			continue;
+		if (sscanf(line, "%d,%d %ms", &fd[0], &fd[1], &target) != 3)
+			fatal("%s:%zu: expected 'rfd,wfd client:port'", path, lineno);
+		addport(target, fd);
+	}
+	if (ferror(f))
+		fatal("read %s:", path);
+	free(line);
+	fclose(f);
 }
 
+/* subscribes our port to and/or from the target port */
 static int
-getportmode(snd_seq_port_info_t *info)
+subscribe(struct port *p, int mode)
 {
-	int caps, mode;
+	snd_seq_port_subscribe_t *sub;
+	snd_seq_addr_t self;
+	int err;
 
-	caps = snd_seq_port_info_get_capability(info);
-	mode = 0;
-	if (caps & SND_SEQ_PORT_CAP_READ && caps & SND_SEQ_PORT_CAP_SUBS_READ)
-		mode |= READ;
-	if (caps & SND_SEQ_PORT_CAP_WRITE && caps & SND_SEQ_PORT_CAP_SUBS_WRITE)
-		mode |= WRITE;
-	return mode;
+	self.client = snd_seq_client_id(seq);
+	self.port = p->self;
+	err = snd_seq_port_subscribe_malloc(&sub);
+	if (err)
+		fatal("snd_seq_port_subscribe_malloc: %s", snd_strerror(err));
+	if (mode & READ) {
+		snd_seq_port_subscribe_set_sender(sub, &p->dest);
+		snd_seq_port_subscribe_set_dest(sub, &self);
+		if (tflag || stampflag) {
+			snd_seq_port_subscribe_set_queue(sub, queue);
+			snd_seq_port_subscribe_set_time_update(sub, 1);
+			snd_seq_port_subscribe_set_time_real(sub, 1);
+		}
+		err = snd_seq_subscribe_port(seq, sub);
+	}
+	if (!err && mode & WRITE) {
+		snd_seq_port_subscribe_set_sender(sub, &self);
+		snd_seq_port_subscribe_set_dest(sub, &p->dest);
+		err = snd_seq_subscribe_port(seq, sub);
+	}
+	snd_seq_port_subscribe_free(sub);
+	return err;
 }
 
+/*
+Subscribes to the system announce port on a sequencer handle of its
+own, so that announcements reach announcereader whatever the mode and
+event filter of the ports.
+*/
 static void
-listports(int mode)
+openannounce(const char *name)
 {
-	int err, portmode;
+	int err, port;
 
-	snd_seq_client_info_t *clientinfo;
-	snd_seq_port_info_t *portinfo;
-
-	err = snd_seq_client_info_malloc(&clientinfo);
+	err = snd_seq_open(&announceseq, "default", SND_SEQ_OPEN_INPUT, 0);
 	if (err)
-		fatal("snd_seq_client_info_malloc: %s", snd_strerror(err));
-	err = snd_seq_port_info_malloc(&portinfo);
+		fatal("snd_seq_open: %s", snd_strerror(err));
+	err = snd_seq_set_client_name(announceseq, name);
 	if (err)
-		fatal("snd_seq_client_info_malloc: %s", snd_strerror(err));
-
-	snd_seq_client_info_set_client(clientinfo, -1);
-	for (;;) {
-		err = snd_seq_query_next_client(seq, clientinfo);
-		if (err == -ENOENT)
-			break;
-		if (err)
-			fatal("snd_seq_query_next_client: %s", snd_strerror(err));
-		snd_seq_port_info_set_client(portinfo, snd_seq_client_info_get_client(clientinfo));
-		snd_seq_port_info_set_port(portinfo, -1);
-		for (;;) {
-			err = snd_seq_query_next_port(seq, portinfo);
-			if (err == -ENOENT)
-				break;
-			if (err)
-				fatal("snd_seq_query_next_port: %s", snd_strerror(err));
-			portmode = getportmode(portinfo);
-			if (!(mode & portmode))
-				continue;
-			printf("%3d:%-3d %c%c\t%-32s %s\n",
-				snd_seq_port_info_get_client(portinfo),
-				snd_seq_port_info_get_port(portinfo),
-				portmode & READ ? 'r' : '-',
-				portmode & WRITE ? 'w' : '-',
-				snd_seq_client_info_get_name(clientinfo),
-				snd_seq_port_info_get_name(portinfo));
-		}
-	}
+		fatal("snd_seq_set_client_name: %s", snd_strerror(err));
+	port = snd_seq_create_simple_port(announceseq, "announce", SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_NO_EXPORT, SND_SEQ_PORT_TYPE_APPLICATION);
+	if (port < 0)
+		fatal("snd_seq_create_simple_port: %s", snd_strerror(port));
+	err = snd_seq_connect_from(announceseq, port, SND_SEQ_CLIENT_SYSTEM, SND_SEQ_PORT_SYSTEM_ANNOUNCE);
+	if (err)
+		fatal("snd_seq_connect_from: %s", snd_strerror(err));
 }
 
+/* resolves the target of a disconnected port again, and resubscribes */
 static void
-writefull(int fd, const unsigned char *buf, size_t len)
+reconnect(struct port *p, long long announced, snd_seq_port_info_t *info)
 {
-	const unsigned char *pos;
-	ssize_t ret;
+	long long now;
+	int err, mode;
 
-	pos = buf;
-	while (len > 0) {
-		ret = write(fd, pos, len);
-		if (ret < 0) {
-			perror("write");
-			exit(1);
-		}
-		pos += ret;
-		len -= ret;
+	if (snd_seq_parse_address(announceseq, &p->dest, p->target) != 0)
+		return;
+	if (snd_seq_get_any_port_info(announceseq, p->dest.client, p->dest.port, info) != 0)
+		return;
+	mode = p->mode & getportmode(info);
+	if (!mode)
+		return;
+	err = subscribe(p, mode);
+	if (err) {
+		fprintf(stderr, "snd_seq_subscribe_port '%s': %s\n", p->target, snd_strerror(err));
+		return;
 	}
+	now = monotime();
+	p->connected = 1;
+	++nreconnects;
+	downtime += now - p->lost;
+	if (announced >= 0 && now - announced > maxreconnect)
+		maxreconnect = now - announced;
+	fprintf(stderr, "port '%s' reconnected as %d:%d after %.3f s\n", p->target, p->dest.client, p->dest.port, (now - p->lost) / 1e9);
 }
 
 static void *
-midireader(void *arg)
+announcereader(void *arg)
 {
-	int fd;
-	ssize_t ret;
 	snd_seq_event_t *evt;
-	unsigned char *pos, *end, buf[1024];
+	struct port *p;
+	snd_seq_port_info_t *info;
+	long long now;
+	size_t i;
+	int err;
 
-	fd = *(int *)arg;
-	pos = buf;
-	end = buf + sizeof buf;
+	err = snd_seq_port_info_malloc(&info);
+	if (err)
+		fatal("snd_seq_port_info_malloc: %s", snd_strerror(err));
 	for (;;) {
-		do {
-			ret = snd_seq_event_input(seq, &evt);
-			if (ret < 0) {
-				fprintf(stderr, "snd_seq_event_input: %s\n", snd_strerror(ret));
-				if (ret == -ENOSPC)
+		err = snd_seq_event_input(announceseq, &evt);
+		now = monotime();
+		if (err == -ENOSPC) {
+			/* announcements were lost, so check every target */
+			for (i = 0; i < nports; ++i) {
+				p = &ports[i];
+				if (p->connected && snd_seq_get_any_port_info(announceseq, p->dest.client, p->dest.port, info) != 0) {
+					p->connected = 0;
+					p->lost = now;
+				}
+				if (!p->connected)
+					reconnect(p, -1, info);
+			}
+			continue;
+		}
+		if (err < 0)
+			fatal("snd_seq_event_input: %s", snd_strerror(err));
+		switch (evt->type) {
+		case SND_SEQ_EVENT_PORT_EXIT:
+		case SND_SEQ_EVENT_CLIENT_EXIT:
+			/* the kernel removes the subscriptions */
+			for (i = 0; i < nports; ++i) {
+				p = &ports[i];
+				if (!p->connected || p->dest.client != evt->data.addr.client)
 					continue;
-				exit(1);
+				if (evt->type == SND_SEQ_EVENT_PORT_EXIT && p->dest.port != evt->data.addr.port)
+					continue;
+				p->connected = 0;
+				p->lost = now;
+				fprintf(stderr, "port '%s' disconnected\n", p->target);
 			}
-		decode:
-			ret = snd_midi_event_decode(dev, pos, end - pos, evt);
-			if (ret < 0) {
-				if (ret == -ENOENT)
-					continue;  /* not a midi message */
-				if (ret == -ENOMEM && pos != buf) {
-					writefull(fd, buf, pos - buf);
-					pos = buf;
-					goto decode;
-				}
-				fatal("snd_midi_event_decode: %s", snd_strerror(ret));
+			break;
+		case SND_SEQ_EVENT_PORT_START:
+			for (i = 0; i < nports; ++i) {
+				if (!ports[i].connected)
+					reconnect(&ports[i], now, info);
 			}
-			pos += ret;
-		} while (snd_seq_event_input_pending(seq, 0) && end - pos >= 3);
-		writefull(fd, buf, pos - buf);
-		pos = buf;
+			break;
+		}
 	}
 	return NULL;
 }
 
 static void
-inputreader(int fd)
+openport(struct port *p, const char *name, int mode, int sflag)
 {
-	snd_seq_event_t evt;
-	ssize_t ret;
-	size_t len;
-	unsigned char *pos, buf[1024];
+	snd_seq_port_info_t *info;
+	snd_seq_addr_t self;
+	int err, cap, missing;
 
-	snd_seq_ev_set_source(&evt, 0);
-	snd_seq_ev_set_subs(&evt);
-	snd_seq_ev_set_direct(&evt);
-	for (;;) {
-		ret = read(fd, buf, sizeof buf);
-		if (ret < 0) {
-			perror("read");
-			exit(1);
-		}
-		if (ret == 0)
-			break;
-		pos = buf;
-		len = ret;
-		while (len > 0) {
-			ret = snd_midi_event_encode(dev, pos, len, &evt);
-			if (ret < 0)
-				fatal("snd_midi_event_encode: %s", snd_strerror(ret));
-			pos += ret;
-			len -= ret;
-			if (evt.type != SND_SEQ_EVENT_NONE) {
-				ret = snd_seq_event_output(seq, &evt);
-				if (ret < 0)
-					fatal("snd_seq_event_output: %s", snd_strerror(ret));
-			}
+	missing = 0;
+	if (p->target) {
+		err = snd_seq_parse_address(seq, &p->dest, p->target);
+		if (err && Pflag) {
+			/* subscribed by announcereader once it appears */
+			fprintf(stderr, "waiting for port '%s'\n", p->target);
+			missing = 1;
+		} else if (err) {
+			fatal("snd_seq_parse_address '%s': %s", p->target, snd_strerror(err));
 		}
-		do {
-			ret = snd_seq_drain_output(seq);
-			if (ret < 0 && ret != -EAGAIN)
-				fatal("snd_seq_drain_output: %s", snd_strerror(ret));
-		} while (ret != 0);
 	}
-}
+	cap = 0;
+	if (mode & READ)
+		cap |= SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE;
+	if (mode & WRITE)
+		cap |= SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ;
+	if (p->target && !sflag)
+		cap &= ~(SND_SEQ_PORT_CAP_SUBS_READ | SND_SEQ_PORT_CAP_SUBS_WRITE);
+	err = snd_seq_port_info_malloc(&info);
+	if (err)
+		fatal("snd_seq_port_info_malloc: %s", snd_strerror(err));
+	if (tflag || stampflag) {
+		/* stamp incoming events with the queue's real time */
+		snd_seq_port_info_set_timestamping(info, 1);
+		snd_seq_port_info_set_timestamp_real(info, 1);
+		snd_seq_port_info_set_timestamp_queue(info, queue);
+	}
+	snd_seq_port_info_set_name(info, name);
+	snd_seq_port_info_set_capability(info, cap);
+	snd_seq_port_info_set_type(info, SND_SEQ_PORT_TYPE_MIDI_GENERIC);
+	err = snd_seq_create_port(seq, info);
+	if (err)
+		fatal("snd_seq_create_port: %s", snd_strerror(err));
 
-static void
-parseintpair(const char *arg, int num[static 2])
-{
-	char *end;
-	long n;
+	self.client = snd_seq_client_id(seq);
+	self.port = snd_seq_port_info_get_port(info);
+	p->self = self.port;
+	if (p->self >= LEN(portmap))
+		fatal("too many ports");
+	portmap[p->self] = p;
+	if (!p->target || sflag)
+		fprintf(stderr, "using port %d:%d\n", self.client, self.port);
+	if (missing) {
+		p->lost = monotime();
+	} else if (p->target) {
+		err = snd_seq_get_any_port_info(seq, p->dest.client, p->dest.port, info);
+		if (err)
+			fatal("snd_seq_get_any_port_info: %s", snd_strerror(err));
+		setenv("MIDIPORT", snd_seq_port_info_get_name(info), 1);
 
-	num[0] = -1;
-	if (*arg != ',') {
-		n = strtol(arg, &end, 10);
-		if (end == arg || n < 0 || n > INT_MAX)
-			usage();
-		num[0] = (int)n;
-		if (!*end) {
-			num[1] = num[0];
-			return;
-		}
-		if (*end != ',')
-			usage();
-		arg = end + 1;
+		mode &= getportmode(info);
+		if (!mode)
+			fatal("port '%s' does not have any matching I/O capabilities", p->target);
+		err = subscribe(p, mode);
+		if (err)
+			fatal("snd_seq_subscribe_port: %s", snd_strerror(err));
+		p->connected = 1;
 	}
-	num[1] = -1;
-	if (*arg) {
-		n = strtol(arg, &end, 10);
-		if (end == arg || *end || n < 0 || n > INT_MAX)
-			usage();
-		num[1] = (int)n;
+	snd_seq_port_info_free(info);
+	p->mode = mode;
+
+	err = snd_midi_event_new(1024, &p->dev);
+	if (err)
+		fatal("snd_midi_event_new: %s", snd_strerror(err));
+	/* running status is added by decodeevent in -z mode */
+	snd_midi_event_no_status(p->dev, 1);
+	snd_seq_ev_set_source(&p->in.evt, p->self);
+	snd_seq_ev_set_subs(&p->in.evt);
+	snd_seq_ev_set_direct(&p->in.evt);
+	if (uflag) {
+		snd_seq_ev_set_source(&p->in.uevt, p->self);
+		snd_seq_ev_set_subs(&p->in.uevt);
+		snd_seq_ev_set_direct(&p->in.uevt);
+		p->in.uevt.flags = SND_SEQ_EVENT_UMP;
 	}
 }
 
@@ -213,24 +3403,65 @@ int
 main(int argc, char *argv[])
 {
 	int err, lflag, sflag;
-	snd_seq_port_info_t *info;
-	snd_seq_addr_t dest, self;
-	snd_seq_port_subscribe_t *sub;
+	long outbufsize, qsize, nworkers;
+	sigset_t sigs;
 	pthread_t thread;
-	char *port, *name;
-	int fd[2], mode, cap;
+	struct port *p;
+	char *name, *config, *attachpath, **targets;
+	int (*fds)[2];
+	size_t i, ntargets, nfds;
+	int mode, sock;
 
 	mode = 0;
 	lflag = 0;
 	sflag = 0;
+	outbufsize = 0;
+	qsize = 4096;
+	nworkers = 0;
 	name = "alsaseqio";
-	port = NULL;
-	fd[0] = 0;
-	fd[1] = 1;
+	config = NULL;
+	attachpath = NULL;
+	targets = calloc(argc, sizeof *targets);
+	fds = calloc(argc, sizeof *fds);
+	if (!targets || !fds)
+		fatal("calloc:");
+	ntargets = 0;
+	nfds = 0;
+	starttime = monotime();
 	ARGBEGIN {
 	case 'l':
 		lflag = 1;
 		break;
+	case 'm':
+		mflag = 1;
+		break;
+	case 'J':
+		jflag = 1;
+		break;
+	case 'W':
+		Wflag = 1;
+		break;
+	case 'P':
+		Pflag = 1;
+		break;
+	case 'D':
+		daemonpath = EARGF(usage());
+		break;
+	case 'A':
+		attachpath = EARGF(usage());
+		break;
+	case 'T':
+		tappath = EARGF(usage());
+		break;
+	case 'x':
+		parsesched(EARGF(usage()));
+		break;
+	case 'S':
+		statspath = EARGF(usage());
+		break;
+	case 'o':
+		statsfd = parseint(EARGF(usage()));
+		break;
 	case 'r':
 		mode |= READ;
 		break;
@@ -241,99 +3472,286 @@ main(int argc, char *argv[])
 		name = EARGF(usage());
 		break;
 	case 'p':
-		port = EARGF(usage());
+		targets[ntargets++] = EARGF(usage());
+		break;
+	case 'c':
+		config = EARGF(usage());
+		break;
+	case 'j':
+		nworkers = parseint(EARGF(usage()));
+		if (nworkers == 0)
+			usage();
 		break;
 	case 's':
 		sflag = 1;
 		break;
+	case 't':
+		tflag = 1;
+		break;
+	case 'e':
+		eflag = 1;
+		break;
 	case 'f':
-		parseintpair(EARGF(usage()), fd);
+		parseintpair(EARGF(usage()), fds[nfds++]);
+		break;
+	case 'v':
+		vflag = 1;
+		break;
+	case 'a':
+		lookahead = parseint(EARGF(usage()));
+		break;
+	case 'B':
+		outbufsize = parseint(EARGF(usage()));
+		/* room for the largest system exclusive event encoded from one read */
+		if (outbufsize < (long)sizeof(snd_seq_event_t) + 4096)
+			fatal("-B: at least %zu bytes", sizeof(snd_seq_event_t) + 4096);
+		break;
+	case 'L':
+		outlatency = parseint(EARGF(usage()));
+		break;
+	case 'C':
+		sysexchunk = parseint(EARGF(usage()));
+		break;
+	case 'R':
+		pacerate = parseint(EARGF(usage()));
+		break;
+	case 'g':
+		sysexgap = parseint(EARGF(usage()));
+		break;
+	case 'u':
+		uflag = 1;
+		break;
+	case 'z':
+		zflag = 1;
+		break;
+	case 'K':
+		cowindow = parseint(EARGF(usage()));
+		break;
+	case 'F':
+		if (midifilterparse(&filter, EARGF(usage())) != 0)
+			usage();
+		fflag = 1;
+		break;
+	case 'q':
+		qpolicy = parsepolicy(EARGF(usage()));
+		break;
+	case 'Q':
+		qsize = parseint(EARGF(usage()));
+		if (qsize == 0)
+			usage();
 		break;
 	default:
 		usage();
 	} ARGEND
 
+	/* the tap only reads, and has no descriptors of its own */
+	if (tappath) {
+		if (mode & WRITE || argc || nfds || config || ntargets > 1 || daemonpath || attachpath || mflag)
+			usage();
+		/* consumers may start at any write, so no running status */
+		if (eflag || zflag || qpolicy != QNONE)
+			usage();
+		mode = READ;
+	}
 	if (mode == 0)
 		mode = READ | WRITE;
+	if ((jflag || Wflag) && !lflag)
+		usage();
+	/* -P follows target ports */
+	if (Pflag && ntargets == 0 && !config)
+		usage();
+	if (attachpath) {
+		if (ntargets != 1 || nfds > 1 || argc == 0 || daemonpath || config || mflag || statspath || statsfd != -1)
+			usage();
+		runattached(attachpath, targets[0], nfds ? fds[0] : (int[]){0, 1}, argv);
+	}
+	/* the ports of -D mode get their descriptors from clients */
+	if (daemonpath && (ntargets == 0 || nfds > 0 || config || argc))
+		usage();
+	if ((tflag || eflag) && qpolicy != QNONE)
+		usage();
+	if (tflag && zflag)
+		usage();
+	if (eflag && cowindow > 0)
+		usage();
+	/* the rings are serviced by the blocking reader and writer threads */
+	if (mflag && eflag)
+		usage();
+	/* UMP packets bypass the MIDI 1.0 byte stream processing */
+	if (uflag && (eflag || tflag || zflag || fflag || qpolicy != QNONE || cowindow || sysexchunk || pacerate || sysexgap))
+		usage();
+	/* the i-th -f option applies to the i-th -p option */
+	if (nfds > (ntargets > 1 ? ntargets : 1) || (config && (ntargets > 0 || nfds > 0)))
+		usage();
+	/* ports sharing the standard descriptors would interleave their streams */
+	if (ntargets > 1 && !daemonpath && nfds != ntargets)
+		usage();
+	for (i = 0; i < ntargets || i < nfds || (i == 0 && !config); ++i)
+		addport(i < ntargets ? targets[i] : NULL, i < nfds ? fds[i] : daemonpath || tappath ? (int[]){-1, -1} : (int[]){0, 1});
+	if (config)
+		readconfig(config);
+	free(targets);
+	free(fds);
+	if (nports > 1 || config || daemonpath) {
+		/* one sequencer reader, and workers servicing the descriptors */
+		if (argc || tflag || eflag || uflag || outlatency || mflag)
+			usage();
+		if (nports == 0)
+			fatal("%s: no ports", config);
+		/* a slow reader must not stall the shared sequencer reader */
+		if (qpolicy == QNONE)
+			qpolicy = QOLDEST;
+	}
+	if (statsfd != -1 && fcntl(statsfd, F_GETFD) < 0)
+		fatal("-o %d:", statsfd);
+	/* the latency histogram needs timestamped events */
+	stampflag = xflag || statspath || statsfd != -1;
 
 	err = snd_seq_open(&seq, "default", SND_SEQ_OPEN_DUPLEX, 0);
 	if (err)
 		fatal("snd_seq_open: %s", snd_strerror(err));
 	if (lflag) {
+		if (Wflag) {
+			err = snd_seq_set_client_name(seq, name);
+			if (err)
+				fatal("snd_seq_set_client_name: %s", snd_strerror(err));
+		}
 		listports(mode);
 		return 0;
 	}
 	err = snd_seq_set_client_name(seq, name);
 	if (err)
 		fatal("snd_seq_set_client_name: %s", snd_strerror(err));
-	if (port) {
-		err = snd_seq_parse_address(seq, &dest, port);
+	if (uflag) {
+		/* the kernel converts to and from legacy clients */
+		err = snd_seq_set_client_midi_version(seq, SND_SEQ_CLIENT_UMP_MIDI_2_0);
 		if (err)
-			fatal("snd_seq_parse_address '%s': %s", port, snd_strerror(err));
+			fatal("snd_seq_set_client_midi_version: %s", snd_strerror(err));
 	}
-	cap = 0;
-	if (mode & READ)
-		cap |= SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE;
-	if (mode & WRITE)
-		cap |= SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ;
-	if (port && !sflag)
-		cap &= ~(SND_SEQ_PORT_CAP_SUBS_READ | SND_SEQ_PORT_CAP_SUBS_WRITE);
-	err = snd_seq_create_simple_port(seq, name, cap, SND_SEQ_PORT_TYPE_MIDI_GENERIC);
-	if (err)
-		fatal("snd_seq_create_simple_port: %s", snd_strerror(err));
-
-	err = snd_seq_port_info_malloc(&info);
-	if (err)
-		fatal("snd_seq_port_info_malloc: %s", snd_strerror(err));
-	self.client = snd_seq_client_id(seq);
-	self.port = 0;
-	if (!port || sflag)
-		fprintf(stderr, "using port %d:%d\n", self.client, self.port);
-	if (port) {
-		err = snd_seq_get_any_port_info(seq, dest.client, dest.port, info);
+	if (fflag)
+		setkernelfilter();
+	if (outbufsize) {
+		err = snd_seq_set_output_buffer_size(seq, outbufsize);
 		if (err)
-			fatal("snd_seq_get_any_port_info: %s", snd_strerror(err));
-		setenv("MIDIPORT", snd_seq_port_info_get_name(info), 1);
-		snd_seq_port_info_free(info);
-
-		mode &= getportmode(info);
-		if (!mode)
-			fatal("port '%s' does not have any matching I/O capabilities");
-		err = snd_seq_port_subscribe_malloc(&sub);
+			fatal("snd_seq_set_output_buffer_size: %s", snd_strerror(err));
+	}
+	if (tflag || stampflag || pacerate > 0 || sysexgap > 0) {
+		queue = snd_seq_alloc_named_queue(seq, name);
+		if (queue < 0)
+			fatal("snd_seq_alloc_named_queue: %s", snd_strerror(queue));
+		err = snd_seq_start_queue(seq, queue, NULL);
 		if (err)
-			fatal("snd_seq_port_subscribe_malloc: %s", snd_strerror(err));
-		if (mode & READ) {
-			snd_seq_port_subscribe_set_sender(sub, &dest);
-			snd_seq_port_subscribe_set_dest(sub, &self);
-			err = snd_seq_subscribe_port(seq, sub);
-			if (err)
-				fatal("snd_seq_subscribe_port: %s", snd_strerror(err));
+			fatal("snd_seq_start_queue: %s", snd_strerror(err));
+		err = snd_seq_drain_output(seq);
+		if (err < 0)
+			fatal("snd_seq_drain_output: %s", snd_strerror(err));
+		/* before any thread uses queuetime */
+		queuebase = seqqueuebase(seq, queue);
+	}
+	if (Pflag)
+		openannounce(name);
+	for (i = 0; i < nports; ++i) {
+		p = &ports[i];
+		if (daemonpath) {
+			openport(p, p->target, mode, sflag);
+			pthread_mutex_init(&p->fdlock, NULL);
+		} else if (nports > 1 || config) {
+			/* a missing descriptor disables that direction */
+			openport(p, p->target, mode & (p->fd[0] >= 0 ? ~0 : ~WRITE) & (p->fd[1] >= 0 ? ~0 : ~READ), sflag);
+		} else {
+			openport(p, name, mode, sflag);
 		}
-		if (mode & WRITE) {
-			snd_seq_port_subscribe_set_sender(sub, &self);
-			snd_seq_port_subscribe_set_dest(sub, &dest);
-			err = snd_seq_subscribe_port(seq, sub);
-			if (err)
-				fatal("snd_seq_subscribe_port: %s", snd_strerror(err));
+		if (cowindow > 0) {
+			if (p->mode & READ)
+				p->co = newcoalesce();
+			if (p->mode & WRITE)
+				p->in.co = newcoalesce();
+		}
+		if (p->mode & READ && qpolicy != QNONE) {
+			p->q = calloc(1, sizeof *p->q);
+			if (!p->q)
+				fatal("calloc:");
+			ringinit(&p->q->ring, qsize);
 		}
 	}
 
-	err = snd_midi_event_new(1024, &dev);
-	if (err)
-		fatal("snd_midi_event_new: %s", snd_strerror(err));
-
-	if (argc)
-		spawn(argv[0], argv, mode, fd);
+	if (mflag) {
+		openrings(&ports[0], argc ? argv : NULL);
+	} else if (argc) {
+		mode = ports[0].mode;
+		spawn(argv[0], argv, mode, ports[0].fd);
+	}
+	if (xflag)
+		lockmemory();
 
-	if (mode & READ) {
-		if (mode & WRITE) {
-			err = pthread_create(&thread, NULL, midireader, &fd[1]);
+	if (vflag || mflag || statsfd != -1) {
+		sigemptyset(&sigs);
+		/* close the rings of -m before exiting on a signal */
+		if (vflag || mflag) {
+			sigaddset(&sigs, SIGINT);
+			sigaddset(&sigs, SIGTERM);
+		}
+		if (vflag) {
+			sigaddset(&sigs, SIGUSR1);
+			atexit(report);
+		}
+		if (statsfd != -1)
+			sigaddset(&sigs, SIGUSR2);
+		err = pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+		if (err)
+			fatal("pthread_sigmask: %s", strerror(err));
+		err = pthread_create(&thread, NULL, sigreader, &sigs);
+		if (err)
+			fatal("pthread_create: %s", strerror(err));
+	}
+	if (statspath)
+		startstats(statspath);
+	if (Pflag) {
+		err = pthread_create(&thread, NULL, announcereader, NULL);
+		if (err)
+			fatal("pthread_create: %s", strerror(err));
+	}
+	if (nports > 1 || config || daemonpath) {
+		if (nworkers == 0) {
+			nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+			if (nworkers < 1 || nworkers > nports)
+				nworkers = nports;
+		}
+		startworkers(nworkers);
+		if (daemonpath) {
+			/* clients that go away are noticed on write */
+			signal(SIGPIPE, SIG_IGN);
+			sock = listenunix(daemonpath, SOCK_SEQPACKET);
+			err = pthread_create(&thread, NULL, daemonloop, &sock);
+			if (err)
+				fatal("pthread_create: %s", strerror(err));
+		}
+		midireader(NULL);
+		return 0;
+	}
+	p = &ports[0];
+	if (eflag) {
+		eventloop(p);
+		return 0;
+	}
+	if (tappath)
+		starttap(tappath);
+	if (p->q) {
+		err = pthread_create(&thread, NULL, ringwriter, p);
+		if (err)
+			fatal("pthread_create: %s", strerror(err));
+	}
+	if (p->mode & READ) {
+		if (p->mode & WRITE) {
+			err = pthread_create(&thread, NULL, uflag ? umpreader : midireader, NULL);
 			if (err)
 				fatal("pthread_create: %s", strerror(err));
+		} else if (uflag) {
+			umpreader(NULL);
 		} else {
-			midireader(&fd[1]);
+			midireader(NULL);
 		}
 	}
-	if (mode & WRITE)
-		inputreader(fd[0]);
+	if (p->mode & WRITE)
+		inputreader(p);
 }
@@ -0,0 +1,157 @@
+/*
+Checks that the variable-length quantity and 7-bit packing helpers of
+intpack.h round trip, and that the bulk 7-bit kernels match the scalar
+ones for every length and alignment, then measures their throughput.
+
+usage: bench/intpack [-n megabytes]
+*/
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../fatal.h"
+#include "../intpack.h"
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+checkvlq(void)
+{
+	static const uint_least32_t edge[] = {
+		0, 1, 0x7f, 0x80, 0x3fff, 0x4000, 0x1fffff, 0x200000, 0xfffffff,
+	};
+	unsigned char buf[8], *end;
+	uint_least32_t v, x;
+	size_t len;
+	int i;
+
+	x = 0;
+	for (i = 0; i < 1000000; ++i) {
+		v = i < (int)(sizeof edge / sizeof *edge) ? edge[i] : (uint_least32_t)rand() >> (rand() % 31) & 0xfffffff;
+		end = putvlq(buf, v);
+		len = getvlq(buf, end - buf, &x);
+		if (len != (size_t)(end - buf) || x != v)
+			fatal("vlq %#lx: length %zu, decoded %#lx", (unsigned long)v, len, (unsigned long)x);
+		if (end - buf > 1 && getvlq(buf, end - buf - 1, &x) != 0)
+			fatal("vlq %#lx: truncated quantity accepted", (unsigned long)v);
+	}
+	memset(buf, 0x80, 5);
+	if (getvlq(buf, 5, &x) != 0)
+		fatal("vlq: 5 byte quantity accepted");
+}
+
+static void
+check7(void)
+{
+	unsigned char src[256], a[320], b[320], c[256];
+	size_t n, off, la, lb, lc;
+
+	for (n = 0; n < 200; ++n) {
+		for (off = 0; off < 8; ++off) {
+			for (size_t i = 0; i < n; ++i)
+				src[off + i] = rand();
+			memset(a, 0xaa, sizeof a);
+			memset(b, 0xaa, sizeof b);
+			la = pack7scalar(a, src + off, n);
+			lb = pack7(b + off, src + off, n);
+			if (la != n + (n + 6) / 7 || lb != la || memcmp(a, b + off, la) != 0 || b[off + lb] != 0xaa)
+				fatal("pack7: %zu bytes at offset %zu differ", n, off);
+			for (size_t i = 0; i < la; ++i) {
+				if (a[i] & 0x80)
+					fatal("pack7: %zu bytes: high bit set", n);
+			}
+			memset(c, 0xaa, sizeof c);
+			lc = unpack7(c + off, b + off, lb);
+			if (lc != n || memcmp(c + off, src + off, n) != 0 || c[off + n] != 0xaa)
+				fatal("unpack7: %zu bytes at offset %zu differ", n, off);
+			lc = unpack7scalar(c, a, la);
+			if (lc != n || memcmp(c, src + off, n) != 0)
+				fatal("unpack7scalar: %zu bytes differ", n);
+		}
+	}
+}
+
+static void
+bench(size_t n)
+{
+	unsigned char *src, *packed, *out;
+	uint_least32_t v;
+	double t[4], vlq[2];
+	size_t i, len, pos;
+
+	src = malloc(n);
+	packed = malloc(n + n / 7 + 1);
+	out = malloc(n);
+	if (!src || !packed || !out)
+		fatal("malloc:");
+	for (i = 0; i < n; ++i)
+		src[i] = rand();
+
+	t[0] = now();
+	len = pack7scalar(packed, src, n);
+	t[0] = now() - t[0];
+	t[1] = now();
+	pack7(packed, src, n);
+	t[1] = now() - t[1];
+	t[2] = now();
+	unpack7scalar(out, packed, len);
+	t[2] = now() - t[2];
+	t[3] = now();
+	unpack7(out, packed, len);
+	t[3] = now() - t[3];
+	if (memcmp(out, src, n) != 0)
+		fatal("unpack7: output differs");
+	printf("pack7    scalar %7.1f MB/s, bulk %7.1f MB/s\n", n / t[0] / 1e6, n / t[1] / 1e6);
+	printf("unpack7  scalar %7.1f MB/s, bulk %7.1f MB/s\n", n / t[2] / 1e6, n / t[3] / 1e6);
+
+	/* delta times as in a dense track: mostly one or two bytes */
+	vlq[0] = now();
+	for (i = pos = 0; pos + 4 <= n; ++i)
+		pos = (unsigned char *)putvlq(src + pos, (uint_least32_t)i * 37 % 20000) - src;
+	vlq[0] = now() - vlq[0];
+	len = pos;
+	vlq[1] = now();
+	for (i = pos = 0; pos < len; ++i)
+		pos += getvlq(src + pos, len - pos, &v);
+	vlq[1] = now() - vlq[1];
+	printf("vlq      %zu quantities, put %6.2f ns, get %6.2f ns each\n", i, vlq[0] / i * 1e9, vlq[1] / i * 1e9);
+	free(src);
+	free(packed);
+	free(out);
+}
+
+int
+main(int argc, char *argv[])
+{
+	long mb;
+	int opt;
+
+	mb = 64;
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			mb = atol(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: bench/intpack [-n megabytes]\n");
+			return 1;
+		}
+	}
+	if (mb <= 0)
+		fatal("invalid options");
+	srand(1);
+	checkvlq();
+	check7();
+	printf("round trips ok\n");
+	bench(mb << 20);
+	return 0;
+}
@@ -0,0 +1,281 @@
+/*
+Compares one alsaseqio process per port against a single multi-port
+alsaseqio process. Each of the sources is an alsaseqio -w client fed
+with a stream of notes; the sinks read from the sources and write to
+pipes, where the received messages are counted.
+
+usage: bench/multiport [-n ports] [-t seconds] [alsaseqio]
+*/
+#define _POSIX_C_SOURCE 200809L
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "../fatal.h"
+#include "../midiparse.h"
+
+static const char *alsaseqio = "./alsaseqio";
+static int nports = 16;
+static double duration = 2;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+sleepms(long ms)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = ms % 1000 * 1000000;
+	nanosleep(&ts, NULL);
+}
+
+static pid_t
+run(char *argv[], int in, int out)
+{
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0)
+		fatal("fork:");
+	if (pid == 0) {
+		if (in != -1 && dup2(in, 0) < 0)
+			fatal("dup2:");
+		if (out != -1 && dup2(out, 1) < 0)
+			fatal("dup2:");
+		execvp(argv[0], argv);
+		fatal("exec %s:", argv[0]);
+	}
+	return pid;
+}
+
+/* writes notes to fd until killed */
+static pid_t
+generator(int fd)
+{
+	unsigned char buf[3 * 256];
+	pid_t pid;
+	int i;
+
+	pid = fork();
+	if (pid < 0)
+		fatal("fork:");
+	if (pid != 0)
+		return pid;
+	for (i = 0; i < 256; ++i) {
+		buf[i * 3] = i & 1 ? 0x80 : 0x90;
+		buf[i * 3 + 1] = i / 2 & 0x7F;
+		buf[i * 3 + 2] = 0x40;
+	}
+	for (;;) {
+		if (write(fd, buf, sizeof buf) < 0)
+			_exit(1);
+	}
+}
+
+static long
+rss(pid_t pid)
+{
+	char path[64], line[256];
+	FILE *f;
+	long kb;
+
+	snprintf(path, sizeof path, "/proc/%ld/status", (long)pid);
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+	kb = 0;
+	while (fgets(line, sizeof line, f)) {
+		if (sscanf(line, "VmRSS: %ld", &kb) == 1)
+			break;
+	}
+	fclose(f);
+	return kb;
+}
+
+/* counts the messages arriving on the pipes for the configured duration */
+static double
+count(int *fd, int n)
+{
+	struct pollfd *pfd;
+	struct midiparser *parser;
+	struct midimsg m;
+	unsigned char buf[4096], *pos;
+	unsigned long msgs;
+	double start, end;
+	ssize_t len;
+	size_t ret;
+	int i, warm;
+
+	pfd = calloc(n, sizeof *pfd);
+	parser = calloc(n, sizeof *parser);
+	if (!pfd || !parser)
+		fatal("calloc:");
+	for (i = 0; i < n; ++i) {
+		pfd[i].fd = fd[i];
+		pfd[i].events = POLLIN;
+	}
+	msgs = 0;
+	warm = 0;
+	start = now();
+	end = start + 0.5;
+	while (now() < end) {
+		if (poll(pfd, n, 100) < 0)
+			fatal("poll:");
+		for (i = 0; i < n; ++i) {
+			if (!(pfd[i].revents & POLLIN))
+				continue;
+			len = read(fd[i], buf, sizeof buf);
+			if (len <= 0)
+				fatal("read: sink exited");
+			for (pos = buf; len > 0; pos += ret, len -= ret) {
+				ret = midiparse(&parser[i], pos, len, &m);
+				msgs += m.len > 0;
+			}
+		}
+		if (!warm && now() >= end) {
+			/* discard the startup period */
+			warm = 1;
+			msgs = 0;
+			start = now();
+			end = start + duration;
+		}
+	}
+	free(pfd);
+	free(parser);
+	return msgs / (now() - start);
+}
+
+static void
+stop(pid_t *pid, int n)
+{
+	int i;
+
+	for (i = 0; i < n; ++i)
+		kill(pid[i], SIGTERM);
+	for (i = 0; i < n; ++i)
+		waitpid(pid[i], NULL, 0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	pid_t *src, *gen, *sink;
+	int *rd, *wr, p[2], i, opt;
+	char **args, name[32], target[32], fd[32];
+	double rate;
+	long kb;
+
+	while ((opt = getopt(argc, argv, "n:t:")) != -1) {
+		switch (opt) {
+		case 'n':
+			nports = atoi(optarg);
+			break;
+		case 't':
+			duration = atof(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: bench/multiport [-n ports] [-t seconds] [alsaseqio]\n");
+			return 1;
+		}
+	}
+	if (optind < argc)
+		alsaseqio = argv[optind];
+	if (nports <= 0)
+		fatal("invalid port count");
+	signal(SIGPIPE, SIG_IGN);
+	src = calloc(nports, sizeof *src);
+	gen = calloc(nports, sizeof *gen);
+	sink = calloc(nports, sizeof *sink);
+	rd = calloc(nports, sizeof *rd);
+	wr = calloc(nports, sizeof *wr);
+	args = calloc(4 * nports + 6, sizeof *args);
+	if (!src || !gen || !sink || !rd || !wr || !args)
+		fatal("calloc:");
+
+	for (i = 0; i < nports; ++i) {
+		if (pipe(p) != 0)
+			fatal("pipe:");
+		snprintf(name, sizeof name, "benchsrc%d", i);
+		args[0] = (char *)alsaseqio;
+		args[1] = "-w";
+		args[2] = "-n";
+		args[3] = name;
+		args[4] = NULL;
+		src[i] = run(args, p[0], -1);
+		gen[i] = generator(p[1]);
+		close(p[0]);
+		close(p[1]);
+	}
+	sleepms(500);
+	for (i = 0; i < nports; ++i) {
+		if (pipe(p) != 0)
+			fatal("pipe:");
+		rd[i] = p[0];
+		wr[i] = p[1];
+	}
+
+	/* one process per port */
+	for (i = 0; i < nports; ++i) {
+		snprintf(target, sizeof target, "benchsrc%d:0", i);
+		args[0] = (char *)alsaseqio;
+		args[1] = "-r";
+		args[2] = "-p";
+		args[3] = target;
+		args[4] = NULL;
+		sink[i] = run(args, -1, wr[i]);
+	}
+	rate = count(rd, nports);
+	for (kb = 0, i = 0; i < nports; ++i)
+		kb += rss(sink[i]);
+	stop(sink, nports);
+	printf("%-14s %3d ports %12.0f events/s %8ld KiB RSS\n", "per-port", nports, rate, kb);
+
+	/* fresh pipes, so nothing left over from the previous sinks is counted */
+	for (i = 0; i < nports; ++i) {
+		close(rd[i]);
+		close(wr[i]);
+		if (pipe(p) != 0)
+			fatal("pipe:");
+		rd[i] = p[0];
+		wr[i] = p[1];
+	}
+
+	/* one multi-port process */
+	args[0] = (char *)alsaseqio;
+	args[1] = "-r";
+	/* lossless, as the per-port sinks are */
+	args[2] = "-q";
+	args[3] = "block";
+	for (i = 0; i < nports; ++i) {
+		args[4 + i * 4] = "-p";
+		snprintf(target, sizeof target, "benchsrc%d:0", i);
+		args[5 + i * 4] = strdup(target);
+		args[6 + i * 4] = "-f";
+		snprintf(fd, sizeof fd, ",%d", wr[i]);
+		args[7 + i * 4] = strdup(fd);
+		if (!args[5 + i * 4] || !args[7 + i * 4])
+			fatal("strdup:");
+	}
+	args[4 + nports * 4] = NULL;
+	sink[0] = run(args, -1, -1);
+	rate = count(rd, nports);
+	kb = rss(sink[0]);
+	stop(sink, 1);
+	printf("%-14s %3d ports %12.0f events/s %8ld KiB RSS\n", "multi-port", nports, rate, kb);
+
+	stop(gen, nports);
+	stop(src, nports);
+	return 0;
+}
@@ -0,0 +1,290 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef HAVE_ALSA
+#include <alsa/asoundlib.h>
+#include "../seqmidi.h"
+#endif
+#include "../fatal.h"
+#include "../midiparse.h"
+
+#define CHUNK 1024
+
+struct stream {
+	const char *name;
+	unsigned char *buf;
+	size_t len;
+};
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t
+runparse(const struct stream *s)
+{
+	struct midiparser p = {0};
+	struct midimsg m;
+	const unsigned char *pos, *end;
+	size_t n, len, ret;
+
+	n = 0;
+	for (pos = s->buf, end = pos + s->len; pos != end; pos += len) {
+		len = end - pos < CHUNK ? end - pos : CHUNK;
+		for (size_t i = 0; i < len; i += ret) {
+			ret = midiparse(&p, pos + i, len - i, &m);
+			n += m.len > 0;
+		}
+	}
+	return n;
+}
+
+/*
+Parses s and writes its messages to out, with or without running
+status, returning the number of messages.
+*/
+static size_t
+recode(const struct stream *s, unsigned char *out, size_t *len, int runstatus)
+{
+	struct midiparser p = {0};
+	struct midimsg m;
+	unsigned char *pos, last;
+	size_t i, n, ret;
+
+	pos = out;
+	last = 0;
+	n = 0;
+	for (i = 0; i < s->len; i += ret) {
+		ret = midiparse(&p, s->buf + i, s->len - i, &m);
+		if (m.len == 0)
+			continue;
+		memcpy(pos, m.data, m.len);
+		pos += runstatus ? midirunstatus(&last, pos, m.len) : m.len;
+		++n;
+	}
+	*len = pos - out;
+	return n;
+}
+
+static size_t
+runcompress(const struct stream *s)
+{
+	static unsigned char *out;
+	static size_t cap;
+	size_t len;
+
+	/* each message grows by at most its status byte */
+	if (cap < s->len * 3) {
+		cap = s->len * 3;
+		free(out);
+		out = malloc(cap);
+		if (!out)
+			fatal("malloc:");
+	}
+	return recode(s, out, &len, 1);
+}
+
+#ifdef HAVE_ALSA
+static size_t
+runseqencode(const struct stream *s)
+{
+	struct midiparser p = {0};
+	struct midimsg m;
+	snd_seq_event_t evt;
+	const unsigned char *pos, *end;
+	size_t n, len, ret;
+
+	n = 0;
+	for (pos = s->buf, end = pos + s->len; pos != end; pos += len) {
+		len = end - pos < CHUNK ? end - pos : CHUNK;
+		for (size_t i = 0; i < len; i += ret) {
+			ret = midiparse(&p, pos + i, len - i, &m);
+			n += m.len > 0 && seqencode(&evt, &m);
+		}
+	}
+	return n;
+}
+
+static size_t
+runencode(const struct stream *s)
+{
+	static snd_midi_event_t *dev;
+	snd_seq_event_t evt;
+	const unsigned char *pos, *end;
+	size_t n, len;
+	long ret;
+	int err;
+
+	if (!dev) {
+		err = snd_midi_event_new(CHUNK, &dev);
+		if (err)
+			fatal("snd_midi_event_new: %s", snd_strerror(err));
+	}
+	snd_midi_event_reset_encode(dev);
+	n = 0;
+	for (pos = s->buf, end = pos + s->len; pos != end; pos += len) {
+		len = end - pos < CHUNK ? end - pos : CHUNK;
+		for (size_t i = 0; i < len; i += ret) {
+			ret = snd_midi_event_encode(dev, pos + i, len - i, &evt);
+			if (ret < 0)
+				fatal("snd_midi_event_encode: %s", snd_strerror(ret));
+			n += evt.type != SND_SEQ_EVENT_NONE;
+		}
+	}
+	return n;
+}
+#endif
+
+static void
+run(const struct stream *s, const char *name, size_t (*fn)(const struct stream *))
+{
+	double start, t;
+	size_t iter, n;
+
+	start = now();
+	iter = 0;
+	do {
+		n = fn(s);
+		++iter;
+		t = now() - start;
+	} while (t < 0.5);
+	printf("%-12s %-12s %10.1f MB/s %12.0f msg/s\n", s->name, name,
+		s->len * iter / t / 1e6, n * iter / t);
+}
+
+/* compares the size and parse cost of s with and without running status */
+static void
+benchrunstatus(const struct stream *s)
+{
+	struct stream full, rs;
+
+	full.name = rs.name = s->name;
+	full.buf = malloc(s->len * 3);
+	rs.buf = malloc(s->len * 3);
+	if (!full.buf || !rs.buf)
+		fatal("malloc:");
+	recode(s, full.buf, &full.len, 0);
+	recode(s, rs.buf, &rs.len, 1);
+	printf("%-12s %-12s %10zu -> %zu bytes, %.1f%% saved\n", s->name, "runstatus",
+		full.len, rs.len, full.len ? 100.0 * (full.len - rs.len) / full.len : 0.0);
+	run(&full, "parse-full", runparse);
+	run(&rs, "parse-rs", runparse);
+	free(full.buf);
+	free(rs.buf);
+}
+
+static void
+bench(const struct stream *s)
+{
+	run(s, "midiparse", runparse);
+#ifdef HAVE_ALSA
+	run(s, "seqencode", runseqencode);
+	run(s, "midi_event", runencode);
+#endif
+	run(s, "compress", runcompress);
+	benchrunstatus(s);
+}
+
+static void
+synth(struct stream *s, const char *name, size_t len, int kind)
+{
+	unsigned char *pos, *end;
+	unsigned r;
+
+	s->name = name;
+	s->buf = malloc(len);
+	if (!s->buf)
+		fatal("malloc:");
+	s->len = len;
+	r = 1;
+	pos = s->buf;
+	end = pos + len;
+	while (end - pos >= 1024) {
+		r = r * 1103515245 + 12345;
+		switch (kind) {
+		case 0:  /* controllers with running status */
+			*pos++ = 0xB0 | (r >> 16 & 0xF);
+			for (int i = 0; i < 64; ++i) {
+				*pos++ = r >> 8 & 0x7F;
+				*pos++ = i;
+			}
+			break;
+		case 1:  /* notes with clock */
+			for (int i = 0; i < 64; ++i) {
+				*pos++ = 0x90 | (i & 0xF);
+				*pos++ = r >> 8 & 0x7F;
+				*pos++ = 0x40;
+				if (i % 8 == 0)
+					*pos++ = 0xF8;
+			}
+			break;
+		case 2:  /* large system exclusive dumps */
+			*pos++ = 0xF0;
+			for (int i = 0; i < 1000; ++i)
+				*pos++ = ((r >> 8) + i) & 0x7F;
+			*pos++ = 0xF7;
+			break;
+		}
+	}
+	s->len = pos - s->buf;
+}
+
+static void
+load(struct stream *s, const char *path)
+{
+	FILE *f;
+	size_t n, cap;
+
+	f = fopen(path, "rb");
+	if (!f)
+		fatal("open %s:", path);
+	s->name = path;
+	s->buf = NULL;
+	s->len = 0;
+	cap = 0;
+	do {
+		if (s->len == cap) {
+			cap = cap ? cap * 2 : 1 << 16;
+			s->buf = realloc(s->buf, cap);
+			if (!s->buf)
+				fatal("realloc:");
+		}
+		n = fread(s->buf + s->len, 1, cap - s->len, f);
+		s->len += n;
+	} while (n > 0);
+	if (ferror(f))
+		fatal("read %s:", path);
+	fclose(f);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct stream s;
+
+	if (argc > 1) {
+		/* recorded streams, for example from alsaseqio -r */
+		for (int i = 1; i < argc; ++i) {
+			load(&s, argv[i]);
+			bench(&s);
+			free(s.buf);
+		}
+		return 0;
+	}
+	synth(&s, "controllers", 1 << 22, 0);
+	bench(&s);
+	free(s.buf);
+	synth(&s, "notes", 1 << 22, 1);
+	bench(&s);
+	free(s.buf);
+	synth(&s, "sysex", 1 << 22, 2);
+	bench(&s);
+	free(s.buf);
+}
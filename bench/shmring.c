@@ -0,0 +1,164 @@
+/*
+Compares a pipe with the shared memory ring of shmring.h, as used by
+alsaseqio -m, for passing three byte messages to another process. The
+messages are written one at a time, first as fast as possible and then
+at a fixed rate, and the throughput and CPU time of both processes are
+reported.
+
+usage: bench/shmring [-n messages] [-r messages/s]
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "../fatal.h"
+#include "../shmring.h"
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+cputime(const struct rusage *ru)
+{
+	return ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6
+		+ ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+}
+
+/* reads until end of file, and exits with a failure if the stream is wrong */
+static void
+consume(int fd, struct shmring *r, long n)
+{
+	unsigned char buf[1024];
+	long long total, sum;
+	ssize_t ret;
+	size_t i;
+
+	total = sum = 0;
+	for (;;) {
+		if (r) {
+			ret = shmringread(r, buf, sizeof buf);
+		} else {
+			ret = read(fd, buf, sizeof buf);
+			if (ret < 0)
+				fatal("read:");
+		}
+		if (ret == 0)
+			break;
+		for (i = 0; i < (size_t)ret; ++i)
+			sum += buf[i];
+		total += ret;
+	}
+	_exit(total != n * 3 || sum != n * (0xb0 + 1 + 0x7f));
+}
+
+static void
+bench(const char *name, int ring, long n, long rate)
+{
+	struct shmring *r;
+	struct rusage self[2], child;
+	struct timespec ts;
+	unsigned char msg[3] = {0xb0, 1, 0x7f};
+	double start, t, next;
+	pid_t pid;
+	int p[2], status;
+	long i;
+
+	r = NULL;
+	if (ring) {
+		r = shmringcreate(SHMRINGSIZE, &p[0]);
+		if (!r)
+			fatal("shmringcreate:");
+	} else if (pipe(p) != 0) {
+		fatal("pipe:");
+	}
+	pid = fork();
+	if (pid < 0)
+		fatal("fork:");
+	if (pid == 0) {
+		if (!ring)
+			close(p[1]);
+		consume(p[0], r, n);
+	}
+	if (!ring)
+		close(p[0]);
+	getrusage(RUSAGE_SELF, &self[0]);
+	start = now();
+	next = start;
+	for (i = 0; i < n; ++i) {
+		if (rate > 0) {
+			next += 1.0 / rate;
+			t = next - now();
+			if (t > 0) {
+				ts.tv_sec = t;
+				ts.tv_nsec = (t - ts.tv_sec) * 1e9;
+				nanosleep(&ts, NULL);
+			}
+		}
+		if (ring) {
+			if (shmringwrite(r, msg, sizeof msg) != 0)
+				fatal("shmringwrite: closed");
+		} else if (write(p[1], msg, sizeof msg) != sizeof msg) {
+			fatal("write:");
+		}
+	}
+	if (ring)
+		shmringclose(r);
+	else
+		close(p[1]);
+	if (wait4(pid, &status, 0, &child) < 0)
+		fatal("wait4:");
+	t = now() - start;
+	getrusage(RUSAGE_SELF, &self[1]);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		fatal("%s: reader saw a corrupt stream", name);
+	if (ring) {
+		munmap(r, sizeof *r + r->size);
+		close(p[0]);
+	}
+	printf("%-5s %9.0f msg/s, writer %6.1f ns/msg, reader %6.1f ns/msg of CPU\n",
+		name, n / t, (cputime(&self[1]) - cputime(&self[0])) / n * 1e9, cputime(&child) / n * 1e9);
+}
+
+int
+main(int argc, char *argv[])
+{
+	long n, rate;
+	int opt;
+
+	n = 2000000;
+	rate = 20000;
+	while ((opt = getopt(argc, argv, "n:r:")) != -1) {
+		switch (opt) {
+		case 'n':
+			n = atol(optarg);
+			break;
+		case 'r':
+			rate = atol(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: bench/shmring [-n messages] [-r messages/s]\n");
+			return 1;
+		}
+	}
+	if (n <= 0 || rate <= 0)
+		fatal("invalid options");
+
+	printf("unpaced, %ld messages\n", n);
+	bench("pipe", 0, n, 0);
+	bench("ring", 1, n, 0);
+	n = rate;
+	printf("paced at %ld messages/s, %ld messages\n", rate, n);
+	bench("pipe", 0, n, rate);
+	bench("ring", 1, n, rate);
+	return 0;
+}
@@ -0,0 +1,515 @@
+/*
+Measures smfplay's file handling on a large, dense multitrack file:
+the time until the first event is available and the peak RSS, both for
+the mapped, merged cursors of smf.c and for loading every event into
+memory up front, and the time to merge all events. It then compares
+seeking with the index of smfindex to rescanning from the start, and
+checks that both chase the same state. With ALSA, it also
+plays a shorter file through smfplay and measures the timing error of
+the events as they arrive at a sequencer port. Finally, it checks that
+a file of system exclusive dumps much larger than the sequencer output
+buffer is read, and with ALSA played, in full.
+
+usage: bench/smf [-t tracks] [-n events per track] [smfplay]
+*/
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#ifdef HAVE_ALSA
+#include <alsa/asoundlib.h>
+#endif
+#include "../fatal.h"
+#include "../intpack.h"
+#include "../smf.h"
+
+static const char *smfplay = "./smfplay";
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+Writes a format 1 file where each track alternates note on and note
+off (as running status note on with velocity 0) every interval ticks,
+with the tracks out of phase and a volume change every 16 events, and
+the first track changes the tempo every bar.
+*/
+static void
+generate(const char *path, int ntracks, long nevents, int interval)
+{
+	FILE *fp;
+	unsigned char hdr[14], *buf, *pos;
+	unsigned long len, tick, last;
+	long i;
+	int t;
+
+	fp = fopen(path, "wb");
+	if (!fp)
+		fatal("open %s:", path);
+	memcpy(hdr, "MThd", 4);
+	putbe32(hdr + 4, 6);
+	putbe16(hdr + 8, 1);
+	putbe16(hdr + 10, ntracks + 1);
+	putbe16(hdr + 12, 480);
+	fwrite(hdr, 1, sizeof hdr, fp);
+	buf = malloc(nevents * 8 + 64);
+	if (!buf)
+		fatal("malloc:");
+
+	/* tempo track */
+	pos = buf;
+	len = (unsigned long)nevents * interval;
+	for (tick = last = 0; tick < len; tick += 4 * 480) {
+		pos = putvlq(pos, tick - last);
+		last = tick;
+		*pos++ = 0xFF;
+		*pos++ = 0x51;
+		*pos++ = 3;
+		pos = putbe24(pos, tick / 1920 % 2 ? 400000 : 500000);
+	}
+	memcpy(pos, "\x00\xff\x2f\x00", 4);
+	pos += 4;
+	fwrite("MTrk", 1, 4, fp);
+	putbe32(hdr, pos - buf);
+	fwrite(hdr, 1, 4, fp);
+	fwrite(buf, 1, pos - buf, fp);
+
+	for (t = 0; t < ntracks; ++t) {
+		pos = buf;
+		for (i = 0; i < nevents; ++i) {
+			pos = putvlq(pos, i == 0 ? t % interval : interval);
+			if (i % 16 == 0)
+				*pos++ = 0x90 | (t & 0xF);
+			*pos++ = 36 + (i / 2 + t) % 48;
+			*pos++ = i % 2 ? 0 : 100;
+			if (i % 16 == 15) {
+				*pos++ = 0;
+				*pos++ = 0xB0 | (t & 0xF);
+				*pos++ = 7;
+				*pos++ = (i / 16 + t) % 128;
+			}
+		}
+		memcpy(pos, "\x00\xff\x2f\x00", 4);
+		pos += 4;
+		fwrite("MTrk", 1, 4, fp);
+		putbe32(hdr, pos - buf);
+		fwrite(hdr, 1, 4, fp);
+		fwrite(buf, 1, pos - buf, fp);
+	}
+	free(buf);
+	if (fclose(fp) != 0)
+		fatal("write %s:", path);
+}
+
+/* writes a format 0 file of ndumps system exclusive messages of len bytes each */
+static void
+gensysex(const char *path, int ndumps, unsigned long len)
+{
+	FILE *fp;
+	unsigned char hdr[14], *buf, *pos;
+	unsigned long i;
+	int d;
+
+	fp = fopen(path, "wb");
+	if (!fp)
+		fatal("open %s:", path);
+	memcpy(hdr, "MThd", 4);
+	putbe32(hdr + 4, 6);
+	putbe16(hdr + 8, 0);
+	putbe16(hdr + 10, 1);
+	putbe16(hdr + 12, 480);
+	fwrite(hdr, 1, sizeof hdr, fp);
+	buf = malloc(ndumps * (len + 8) + 4);
+	if (!buf)
+		fatal("malloc:");
+	pos = buf;
+	for (d = 0; d < ndumps; ++d) {
+		/* the F0 is not part of the length */
+		pos = putvlq(pos, d == 0 ? 0 : 120);
+		*pos++ = 0xF0;
+		pos = putvlq(pos, len - 1);
+		for (i = 1; i < len - 1; ++i)
+			*pos++ = (i + d) & 0x7F;
+		*pos++ = 0xF7;
+	}
+	memcpy(pos, "\x00\xff\x2f\x00", 4);
+	pos += 4;
+	fwrite("MTrk", 1, 4, fp);
+	putbe32(hdr, pos - buf);
+	fwrite(hdr, 1, 4, fp);
+	fwrite(buf, 1, pos - buf, fp);
+	free(buf);
+	if (fclose(fp) != 0)
+		fatal("write %s:", path);
+}
+
+/*
+Opens the file in a child process and takes every event, either as it
+goes, or after loading them all into an array. Returns the time until
+the first event is available, and sets the merge time and peak RSS.
+*/
+static double
+load(const char *path, int preload, double *merge, long *maxrss)
+{
+	struct smf f;
+	struct smfevent e, *all;
+	struct rusage ru;
+	double t[3], start;
+	size_t n, cap;
+	int p[2];
+	pid_t pid;
+
+	if (pipe(p) != 0)
+		fatal("pipe:");
+	pid = fork();
+	if (pid < 0)
+		fatal("fork:");
+	if (pid == 0) {
+		start = now();
+		smfopen(&f, path);
+		all = NULL;
+		n = cap = 0;
+		if (preload) {
+			while (smfnext(&f, &e)) {
+				if (n == cap) {
+					cap = cap ? cap * 2 : 1024;
+					all = realloc(all, cap * sizeof *all);
+					if (!all)
+						fatal("realloc:");
+				}
+				all[n++] = e;
+			}
+			e = all[0];
+		} else {
+			smfnext(&f, &e);
+		}
+		t[0] = now() - start;
+		if (preload) {
+			for (size_t i = 1; i < n; ++i)
+				e.time += all[i].time;
+		} else {
+			while (smfnext(&f, &e))
+				;
+		}
+		t[1] = now() - start;
+		getrusage(RUSAGE_SELF, &ru);
+		t[2] = ru.ru_maxrss;
+		write(p[1], t, sizeof t);
+		_exit(0);
+	}
+	close(p[1]);
+	if (read(p[0], t, sizeof t) != sizeof t)
+		fatal("child failed");
+	close(p[0]);
+	waitpid(pid, NULL, 0);
+	*merge = t[1];
+	*maxrss = t[2];
+	return t[0];
+}
+
+static void
+benchload(const char *path, int ntracks, long nevents)
+{
+	static const char *names[] = {"cursors", "preload"};
+	double first, merge;
+	long rss, total;
+	int i;
+
+	total = ntracks * nevents;
+	for (i = 0; i < 2; ++i) {
+		first = load(path, i, &merge, &rss);
+		printf("%-8s first event %8.3f ms, all %8.3f ms (%6.1f Mevents/s), peak rss %7ld KiB\n",
+			names[i], first * 1e3, merge * 1e3, total / merge / 1e6, rss);
+	}
+}
+
+/* seeks to tick by taking every event from the start */
+static void
+rescan(const char *path, unsigned long long tick, struct smfstate *st, struct smfevent *e)
+{
+	struct smf f;
+
+	smfopen(&f, path);
+	memset(st, 0xff, sizeof *st);
+	while (smfnext(&f, e) && e->tick < tick)
+		smfchase(st, e);
+	smfclose(&f);
+}
+
+static void
+benchseek(const char *path, unsigned long long len)
+{
+	struct smf f;
+	struct smfstate st, want;
+	struct smfevent e, wante;
+	char idx[80];
+	unsigned long long tick;
+	double start, build, load, seek, scan;
+	int i, n;
+
+	snprintf(idx, sizeof idx, "%s.idx", path);
+	unlink(idx);
+	start = now();
+	smfopen(&f, path);
+	smfindex(&f, idx, 0);
+	build = now() - start;
+	smfclose(&f);
+	start = now();
+	smfopen(&f, path);
+	smfindex(&f, idx, 0);
+	load = now() - start;
+	printf("index    %zu points, build %8.3f ms, load %8.3f ms\n", f.npoints, build * 1e3, load * 1e3);
+
+	n = 1000;
+	srand(1);
+	start = now();
+	for (i = 0; i < n; ++i) {
+		tick = (unsigned long long)rand() * len / RAND_MAX;
+		smfseek(&f, tick, &st);
+		smfnext(&f, &e);
+	}
+	seek = (now() - start) / n;
+	n = 4;
+	start = now();
+	for (i = 0; i < n; ++i) {
+		tick = len / n * i + len / 7;
+		rescan(path, tick, &want, &wante);
+	}
+	scan = (now() - start) / n;
+	smfseek(&f, tick, &st);
+	smfnext(&f, &e);
+	if (memcmp(&st, &want, sizeof st) != 0 || e.tick != wante.tick || e.time != wante.time || e.track != wante.track)
+		fatal("seek state differs from rescan");
+	printf("seek     indexed %8.3f ms, rescan %8.3f ms\n", seek * 1e3, scan * 1e3);
+	smfclose(&f);
+	unlink(idx);
+}
+
+#ifdef HAVE_ALSA
+/* plays path with smfplay into a port, and counts the system exclusive bytes that arrive */
+static void
+playsysex(const char *path, int ndumps, unsigned long len)
+{
+	snd_seq_t *seq;
+	snd_seq_event_t *evt;
+	unsigned long long total, got;
+	double start;
+	char dest[32];
+	int port, ret, nend;
+	pid_t pid;
+
+	ret = snd_seq_open(&seq, "default", SND_SEQ_OPEN_INPUT, 0);
+	if (ret)
+		fatal("snd_seq_open: %s", snd_strerror(ret));
+	snd_seq_set_client_name(seq, "bench/smf");
+	port = snd_seq_create_simple_port(seq, "bench/smf",
+		SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE, SND_SEQ_PORT_TYPE_MIDI_GENERIC);
+	if (port < 0)
+		fatal("snd_seq_create_simple_port: %s", snd_strerror(port));
+	snprintf(dest, sizeof dest, "%d:%d", snd_seq_client_id(seq), port);
+
+	start = now();
+	pid = fork();
+	if (pid < 0)
+		fatal("fork:");
+	if (pid == 0) {
+		execl(smfplay, smfplay, "-p", dest, path, (char *)NULL);
+		fatal("exec %s:", smfplay);
+	}
+	total = (unsigned long long)ndumps * len;
+	for (got = 0, nend = 0; nend < ndumps;) {
+		ret = snd_seq_event_input(seq, &evt);
+		if (ret < 0)
+			fatal("snd_seq_event_input: %s", snd_strerror(ret));
+		if (evt->type != SND_SEQ_EVENT_SYSEX)
+			continue;
+		got += evt->data.ext.len;
+		nend += ((unsigned char *)evt->data.ext.ptr)[evt->data.ext.len - 1] == 0xF7;
+	}
+	waitpid(pid, &ret, 0);
+	snd_seq_close(seq);
+	if (got != total || !WIFEXITED(ret) || WEXITSTATUS(ret) != 0)
+		fatal("smfplay delivered %llu of %llu sysex bytes", got, total);
+	printf("sysex    played %d dumps of %lu bytes in %8.3f ms\n", ndumps, len, (now() - start) * 1e3);
+}
+
+static int
+cmp(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* plays path with smfplay into a timestamping port, and compares arrival times */
+static void
+benchtiming(const char *path)
+{
+	snd_seq_t *seq;
+	snd_seq_port_info_t *info;
+	snd_seq_event_t *evt;
+	struct smf f;
+	struct smfevent e;
+	struct rusage ru;
+	long long *want, *got, *err;
+	double cpu;
+	char dest[32];
+	size_t i, n, ngot;
+	int q, ret;
+	pid_t pid;
+
+	smfopen(&f, path);
+	for (n = 0; smfnext(&f, &e);)
+		n += (e.type & 0xF0) == 0x90;
+	smfclose(&f);
+	want = calloc(n, sizeof *want);
+	got = calloc(n, sizeof *got);
+	err = calloc(n, sizeof *err);
+	if (!want || !got || !err)
+		fatal("calloc:");
+	smfopen(&f, path);
+	for (i = 0; smfnext(&f, &e);) {
+		if ((e.type & 0xF0) == 0x90)
+			want[i++] = e.time;
+	}
+	smfclose(&f);
+
+	ret = snd_seq_open(&seq, "default", SND_SEQ_OPEN_INPUT, 0);
+	if (ret)
+		fatal("snd_seq_open: %s", snd_strerror(ret));
+	snd_seq_set_client_name(seq, "bench/smf");
+	q = snd_seq_alloc_named_queue(seq, "bench/smf");
+	if (q < 0)
+		fatal("snd_seq_alloc_named_queue: %s", snd_strerror(q));
+	snd_seq_start_queue(seq, q, NULL);
+	snd_seq_drain_output(seq);
+	ret = snd_seq_port_info_malloc(&info);
+	if (ret)
+		fatal("snd_seq_port_info_malloc: %s", snd_strerror(ret));
+	snd_seq_port_info_set_name(info, "bench/smf");
+	snd_seq_port_info_set_capability(info, SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE);
+	snd_seq_port_info_set_type(info, SND_SEQ_PORT_TYPE_MIDI_GENERIC);
+	snd_seq_port_info_set_timestamping(info, 1);
+	snd_seq_port_info_set_timestamp_real(info, 1);
+	snd_seq_port_info_set_timestamp_queue(info, q);
+	ret = snd_seq_create_port(seq, info);
+	if (ret)
+		fatal("snd_seq_create_port: %s", snd_strerror(ret));
+	snprintf(dest, sizeof dest, "%d:%d", snd_seq_client_id(seq), snd_seq_port_info_get_port(info));
+	snd_seq_port_info_free(info);
+
+	pid = fork();
+	if (pid < 0)
+		fatal("fork:");
+	if (pid == 0) {
+		execl(smfplay, smfplay, "-a", "200000", "-p", dest, path, (char *)NULL);
+		fatal("exec %s:", smfplay);
+	}
+	for (ngot = 0; ngot < n;) {
+		ret = snd_seq_event_input(seq, &evt);
+		if (ret < 0)
+			fatal("snd_seq_event_input: %s", snd_strerror(ret));
+		if (evt->type == SND_SEQ_EVENT_NOTEON || evt->type == SND_SEQ_EVENT_NOTEOFF)
+			got[ngot++] = evt->time.time.tv_sec * 1000000000ll + evt->time.time.tv_nsec;
+	}
+	/* earlier children are included in RUSAGE_CHILDREN */
+	getrusage(RUSAGE_CHILDREN, &ru);
+	cpu = -(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6);
+	waitpid(pid, NULL, 0);
+	getrusage(RUSAGE_CHILDREN, &ru);
+	cpu += ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+	snd_seq_close(seq);
+
+	/* relative to the first event, since smfplay starts after a delay */
+	for (i = 0; i < n; ++i) {
+		err[i] = (got[i] - got[0]) - (want[i] - want[0]);
+		if (err[i] < 0)
+			err[i] = -err[i];
+	}
+	qsort(err, n, sizeof *err, cmp);
+	printf("timing   %zu events, error p50 %.1f p99 %.1f max %.1f us, smfplay cpu %.3f s for %.1f s\n",
+		n, err[n / 2] / 1e3, err[n * 99 / 100] / 1e3, err[n - 1] / 1e3,
+		cpu, (want[n - 1] - want[0]) / 1e9);
+	free(want);
+	free(got);
+	free(err);
+}
+#endif
+
+static void
+benchsysex(const char *path, int ndumps, unsigned long len)
+{
+	struct smf f;
+	struct smfevent e;
+	int n;
+
+	gensysex(path, ndumps, len);
+	smfopen(&f, path);
+	for (n = 0; smfnext(&f, &e);) {
+		if (e.type != 0xF0)
+			continue;
+		if (e.len != len - 1 || e.data[e.len - 1] != 0xF7)
+			fatal("sysex read with %zu bytes, want %lu", e.len + 1, len);
+		++n;
+	}
+	smfclose(&f);
+	if (n != ndumps)
+		fatal("read %d sysex dumps, want %d", n, ndumps);
+#ifdef HAVE_ALSA
+	playsysex(path, ndumps, len);
+#else
+	printf("sysex    read %d dumps of %lu bytes\n", ndumps, len);
+#endif
+}
+
+int
+main(int argc, char *argv[])
+{
+	char path[64];
+	long nevents;
+	int opt, ntracks;
+
+	ntracks = 64;
+	nevents = 100000;
+	while ((opt = getopt(argc, argv, "t:n:")) != -1) {
+		switch (opt) {
+		case 't':
+			ntracks = atoi(optarg);
+			break;
+		case 'n':
+			nevents = atol(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: bench/smf [-t tracks] [-n events per track] [smfplay]\n");
+			return 1;
+		}
+	}
+	if (optind < argc)
+		smfplay = argv[optind];
+	if (ntracks <= 0 || ntracks > 0xfffe || nevents <= 0)
+		fatal("invalid options");
+
+	snprintf(path, sizeof path, "/tmp/bench-smf-%d.mid", (int)getpid());
+	generate(path, ntracks, nevents, 24);
+	printf("%d tracks, %ld events per track\n", ntracks, nevents);
+	benchload(path, ntracks, nevents);
+	benchseek(path, (unsigned long long)nevents * 24);
+#ifdef HAVE_ALSA
+	/* 8 tracks with an event every 20 ticks, for about 20 seconds */
+	generate(path, 8, 1000, 20);
+	benchtiming(path);
+#endif
+	benchsysex(path, 8, 256 * 1024);
+	unlink(path);
+	return 0;
+}
@@ -0,0 +1,177 @@
+/*
+Measures the time from starting a short job until its first message
+arrives at a sequencer port, either with alsaseqio opening the
+sequencer and subscribing for each job, or with alsaseqio -A getting
+pipes from a running alsaseqio -D. Each job writes a single note with
+printf(1), and the note is read from a sink alsaseqio -r process.
+
+usage: bench/startup [-n jobs] [alsaseqio]
+*/
+#define _POSIX_C_SOURCE 200809L
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "../fatal.h"
+
+static const char *alsaseqio = "./alsaseqio";
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+sleepms(long ms)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = ms % 1000 * 1000000;
+	nanosleep(&ts, NULL);
+}
+
+static pid_t
+run(char *argv[], int out)
+{
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0)
+		fatal("fork:");
+	if (pid == 0) {
+		if (out != -1 && dup2(out, 1) < 0)
+			fatal("dup2:");
+		execvp(argv[0], argv);
+		fatal("exec %s:", argv[0]);
+	}
+	return pid;
+}
+
+static int
+cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* runs the job n times, and reports the time until its note is read from fd */
+static void
+bench(const char *name, char *argv[], int fd, int n)
+{
+	struct pollfd pfd;
+	unsigned char buf[3];
+	double *t, start, sum;
+	size_t len;
+	ssize_t ret;
+	pid_t pid;
+	int i;
+
+	t = calloc(n, sizeof *t);
+	if (!t)
+		fatal("calloc:");
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	sum = 0;
+	for (i = 0; i < n; ++i) {
+		start = now();
+		pid = run(argv, -1);
+		for (len = 0; len < sizeof buf; len += ret) {
+			if (poll(&pfd, 1, 5000) != 1)
+				fatal("%s: no message after 5 s", name);
+			ret = read(fd, buf + len, sizeof buf - len);
+			if (ret <= 0)
+				fatal("read: sink exited");
+		}
+		t[i] = now() - start;
+		sum += t[i];
+		waitpid(pid, NULL, 0);
+		if (memcmp(buf, "\x90\x3c\x7f", 3) != 0)
+			fatal("%s: unexpected message", name);
+	}
+	qsort(t, n, sizeof *t, cmp);
+	printf("%-8s %d jobs, mean %7.3f ms, p50 %7.3f ms, p99 %7.3f ms\n",
+		name, n, sum / n * 1e3, t[n / 2] * 1e3, t[n * 99 / 100] * 1e3);
+	free(t);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char path[64], *args[16];
+	pid_t sink, server;
+	int p[2], i, n, opt;
+
+	n = 200;
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			n = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: bench/startup [-n jobs] [alsaseqio]\n");
+			return 1;
+		}
+	}
+	if (optind < argc)
+		alsaseqio = argv[optind];
+	if (n <= 0)
+		fatal("invalid job count");
+
+	if (pipe(p) != 0)
+		fatal("pipe:");
+	args[0] = (char *)alsaseqio;
+	args[1] = "-r";
+	args[2] = "-n";
+	args[3] = "benchsink";
+	args[4] = NULL;
+	sink = run(args, p[1]);
+	close(p[1]);
+	sleepms(500);
+
+	args[0] = (char *)alsaseqio;
+	args[1] = "-w";
+	args[2] = "-p";
+	args[3] = "benchsink:0";
+	args[4] = "printf";
+	args[5] = "\\220<\\177";
+	args[6] = NULL;
+	bench("direct", args, p[0], n);
+
+	snprintf(path, sizeof path, "/tmp/bench-startup-%d.sock", (int)getpid());
+	args[1] = "-w";
+	args[2] = "-D";
+	args[3] = path;
+	args[4] = "-p";
+	args[5] = "benchsink:0";
+	args[6] = NULL;
+	server = run(args, -1);
+	for (i = 0; i < 50 && access(path, F_OK) != 0; ++i)
+		sleepms(100);
+	if (i == 50)
+		fatal("%s: daemon did not start", path);
+	args[1] = "-A";
+	args[2] = path;
+	args[3] = "-p";
+	args[4] = "benchsink:0";
+	args[5] = "printf";
+	args[6] = "\\220<\\177";
+	args[7] = NULL;
+	bench("daemon", args, p[0], n);
+
+	kill(server, SIGTERM);
+	waitpid(server, NULL, 0);
+	unlink(path);
+	kill(sink, SIGTERM);
+	waitpid(sink, NULL, 0);
+	return 0;
+}
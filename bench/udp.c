@@ -0,0 +1,202 @@
+/*
+Measures the latency and jitter of udpio over localhost. Note on
+messages are written to one udpio process at a fixed interval and
+read back from its peer, once without loss and once with packets
+dropped at random to exercise journal recovery.
+
+usage: bench/udp [-n messages] [-i usec] [udpio]
+*/
+#define _POSIX_C_SOURCE 200809L
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "../fatal.h"
+#include "../midiparse.h"
+
+static const char *udpio = "./udpio";
+static int nmsg = 2048;
+static long interval = 500;
+
+static long long
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+static pid_t
+run(char *argv[], int in, int out)
+{
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0)
+		fatal("fork:");
+	if (pid == 0) {
+		if (dup2(in, 0) < 0 || dup2(out, 1) < 0)
+			fatal("dup2:");
+		execvp(argv[0], argv);
+		fatal("exec %s:", argv[0]);
+	}
+	return pid;
+}
+
+static int
+cmp(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+bench(const char *name, const char *drop, int port)
+{
+	struct midiparser parser = {0};
+	struct midimsg m;
+	struct pollfd pfd;
+	long long *sent, *lat, next, t, end;
+	unsigned char msg[3], buf[256];
+	char lport[2][32], rport[2][16], *args[2][10];
+	int in[2], out[2], idle[2], i, j, n, got;
+	double jitter;
+	ssize_t len;
+	size_t ret;
+	pid_t pid[2];
+
+	sent = calloc(nmsg, sizeof *sent);
+	lat = calloc(nmsg, sizeof *lat);
+	if (!sent || !lat)
+		fatal("calloc:");
+	for (i = 0; i < 2; ++i) {
+		snprintf(lport[i], sizeof lport[i], "127.0.0.1:%d", port + i);
+		snprintf(rport[i], sizeof rport[i], "%d", port + !i);
+		n = 0;
+		args[i][n++] = (char *)udpio;
+		if (i == 0 && drop) {
+			args[i][n++] = "-d";
+			args[i][n++] = (char *)drop;
+		}
+		args[i][n++] = "-l";
+		args[i][n++] = lport[i];
+		args[i][n++] = "127.0.0.1";
+		args[i][n++] = rport[i];
+		args[i][n] = NULL;
+	}
+	if (pipe(in) != 0 || pipe(out) != 0 || pipe(idle) != 0)
+		fatal("pipe:");
+	/* so that udpio sees EOF when we close our end */
+	for (i = 0; i < 2; ++i) {
+		fcntl(in[i], F_SETFD, FD_CLOEXEC);
+		fcntl(out[i], F_SETFD, FD_CLOEXEC);
+		fcntl(idle[i], F_SETFD, FD_CLOEXEC);
+	}
+	pid[0] = run(args[0], in[0], idle[1]);
+	pid[1] = run(args[1], idle[0], out[1]);
+	close(in[0]);
+	close(out[1]);
+	/* let both sides bind */
+	nanosleep(&(struct timespec){.tv_nsec = 200000000}, NULL);
+
+	pfd.fd = out[0];
+	pfd.events = POLLIN;
+	got = 0;
+	next = now();
+	end = next + (long long)nmsg * interval * 1000 + 1000000000;
+	for (i = 0; now() < end && got < nmsg;) {
+		t = now();
+		if (i < nmsg && t >= next) {
+			msg[0] = 0x90 | (i >> 7 & 0xF);
+			msg[1] = i & 0x7F;
+			msg[2] = 0x40;
+			sent[i] = t;
+			if (write(in[1], msg, 3) != 3)
+				fatal("write:");
+			++i;
+			next += interval * 1000;
+			continue;
+		}
+		if (poll(&pfd, 1, i < nmsg ? (next - t) / 1000000 : 100) <= 0)
+			continue;
+		len = read(out[0], buf, sizeof buf);
+		if (len <= 0)
+			fatal("read: udpio exited");
+		t = now();
+		for (j = 0; j < len; j += ret) {
+			ret = midiparse(&parser, buf + j, len - j, &m);
+			if (m.len == 3 && (m.data[0] & 0xF0) == 0x90) {
+				n = (m.data[0] & 0xF) << 7 | m.data[1];
+				if (n < nmsg && !lat[n]) {
+					lat[n] = t - sent[n];
+					++got;
+				}
+			}
+		}
+	}
+	close(in[1]);
+	close(out[0]);
+	kill(pid[1], SIGTERM);
+	waitpid(pid[0], NULL, 0);
+	waitpid(pid[1], NULL, 0);
+	close(idle[0]);
+	close(idle[1]);
+
+	/* compact to the delivered messages */
+	jitter = 0;
+	for (i = n = 0; i < nmsg; ++i) {
+		if (!lat[i])
+			continue;
+		if (n > 0)
+			jitter += llabs(lat[i] - lat[n - 1]);
+		lat[n++] = lat[i];
+	}
+	if (n > 1)
+		jitter /= n - 1;
+	qsort(lat, n, sizeof *lat, cmp);
+	if (n == 0) {
+		printf("%-10s %d/%d delivered\n", name, n, nmsg);
+	} else {
+		printf("%-10s %d/%d delivered, latency min %.1f p50 %.1f p99 %.1f max %.1f us, jitter %.1f us\n",
+			name, n, nmsg, lat[0] / 1e3, lat[n / 2] / 1e3, lat[n * 99 / 100] / 1e3,
+			lat[n - 1] / 1e3, jitter / 1e3);
+	}
+	free(sent);
+	free(lat);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int opt, port;
+
+	while ((opt = getopt(argc, argv, "n:i:")) != -1) {
+		switch (opt) {
+		case 'n':
+			nmsg = atoi(optarg);
+			break;
+		case 'i':
+			interval = atol(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: bench/udp [-n messages] [-i usec] [udpio]\n");
+			return 1;
+		}
+	}
+	if (optind < argc)
+		udpio = argv[optind];
+	if (nmsg <= 0 || nmsg > 2048 || interval <= 0)
+		fatal("invalid options");
+	signal(SIGPIPE, SIG_IGN);
+	port = 20000 + getpid() % 20000;
+	bench("lossless", NULL, port);
+	bench("10% loss", "10", port + 2);
+	return 0;
+}
@@ -5,6 +5,7 @@
 #include <CoreMIDI/MIDIServices.h>
 #include "arg.h"
 #include "fatal.h"
+#include "midiparse.h"
 #include "spawn.h"
 
 struct context {
@@ -116,12 +117,14 @@ addpacket(struct context *ctx, MIDIPacketList *list, size_t listlen, MIDIPacket
 static void
 handleinput(CFFileDescriptorRef file, CFOptionFlags flags, void *info)
 {
-	static unsigned char data[2], *datapos, *dataend;
+	static struct midiparser parser;
 	struct context *ctx;
+	struct midimsg msg;
 	ssize_t ret;
 	MIDIPacket *p;
-	int b, err;
-	const unsigned char *pos, *end, *tmp;
+	int err;
+	const unsigned char *pos;
+	size_t len;
 	unsigned char buf[1024];
 	union {
 		MIDIPacketList list;
@@ -139,60 +142,13 @@ handleinput(CFFileDescriptorRef file, CFOptionFlags flags, void *info)
 	CFFileDescriptorEnableCallBacks(file, kCFFileDescriptorReadCallBack);
 	p = MIDIPacketListInit(&u.list);
 	pos = buf;
-	end = buf + ret;
-	if (data[0] == 0xF0) {
-	sysex:
-		tmp = pos;
-		while (++pos != end) {
-			if (*pos & 0x80) {
-				if (*pos == 0xF7) {
-					data[0] = 0;
-					++pos;
-				}
-				break;
-			}
-		}
-		p = addpacket(ctx, &u.list, sizeof u, p, tmp, pos - tmp);
-	}
-	for (; pos != end; ++pos) {
-		b = *pos & 0xFF;
-		if (b & 0x80) {
-			datapos = data;
-			switch (b >> 4 & 7) {
-			case 4: case 5:
-				dataend = datapos + 2;
-				break;
-			case 0: case 1: case 2: case 3: case 6:
-				dataend = datapos + 3;
-				break;
-			case 7:
-				if (b >= 0xF8) {
-					dataend = datapos + 1;
-					break;
-				}
-				switch (b & 7) {
-				case 0: dataend = NULL; break;
-				case 6:
-				case 7: dataend = datapos + 1; break;
-				case 1:
-				case 3: dataend = datapos + 2; break;
-				case 2: dataend = datapos + 3; break;
-				case 4:
-				case 5: continue;  /* invalid status byte */
-				}
-				break;
-			}
-		} else if (!data[0]) {
-			continue;  /* invalid (no status byte) */
-		} else if (datapos == dataend)  {
-			/* running status */
-			datapos = data + 1;
-		}
-		*datapos++ = b;
-		if (b == 0xF0)
-			goto sysex;
-		if (datapos == dataend)
-			p = addpacket(ctx, &u.list, sizeof u, p, data, dataend - data);
+	len = ret;
+	while (len > 0) {
+		ret = midiparse(&parser, pos, len, &msg);
+		pos += ret;
+		len -= ret;
+		if (msg.len > 0)
+			p = addpacket(ctx, &u.list, sizeof u, p, msg.data, msg.len);
 	}
 	if (u.list.numPackets > 0) {
 		err = midiwrite(ctx, &u.list);
@@ -2,7 +2,13 @@
 #ifndef INTPACK_H
 #define INTPACK_H
 
+#include <stddef.h>
 #include <stdint.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 static inline void *
 putle16(void *p, uint_least16_t v)
@@ -43,7 +49,7 @@ putbe24(void *p, uint_least32_t v)
 	b[0] = v >> 16 & 0xff;
 	b[1] = v >> 8 & 0xff;
 	b[2] = v & 0xff;
-	return b + 4;
+	return b + 3;
 }
 
 static inline void *
@@ -208,4 +214,160 @@ getbe64(const void *p)
 	return v;
 }
 
+
+/* MIDI variable-length quantity, most significant group first, up to 28 bits */
+static inline void *
+putvlq(void *p, uint_least32_t v)
+{
+	unsigned char *b = p;
+	int n;
+
+	v &= 0xfffffff;
+	n = 7 * ((v >= 1ul << 7) + (v >= 1ul << 14) + (v >= 1ul << 21));
+	for (; n > 0; n -= 7)
+		*b++ = 0x80 | (v >> n & 0x7f);
+	*b++ = v & 0x7f;
+	return b;
+}
+
+/* returns the length of the quantity at p, or 0 (and v = 0) if it is longer than 4 bytes or n */
+static inline size_t
+getvlq(const void *p, size_t n, uint_least32_t *v)
+{
+	const unsigned char *b = p;
+	uint_least32_t x;
+	size_t i;
+
+	if (n > 4)
+		n = 4;
+	x = 0;
+	for (i = 0; i < n; ++i) {
+		x = x << 7 | (b[i] & 0x7f);
+		if (!(b[i] & 0x80)) {
+			*v = x;
+			return i + 1;
+		}
+	}
+	*v = 0;
+	return 0;
+}
+
+/*
+8-to-7 packing of 8-bit data into 7-bit system exclusive data: each
+group of up to 7 bytes is preceded by a byte holding their high bits,
+with bit 0 for the first byte. The functions return the output length,
+and the scalar versions handle groups that are not complete.
+*/
+static inline size_t
+pack7scalar(void *dst, const void *src, size_t n)
+{
+	unsigned char *d = dst, *h;
+	const unsigned char *s = src;
+	size_t i, j;
+
+	for (i = 0; i < n; i += 7) {
+		h = d++;
+		*h = 0;
+		for (j = 0; j < 7 && i + j < n; ++j) {
+			*h |= (s[i + j] >> 7) << j;
+			*d++ = s[i + j] & 0x7f;
+		}
+	}
+	return d - (unsigned char *)dst;
+}
+
+static inline size_t
+unpack7scalar(void *dst, const void *src, size_t n)
+{
+	unsigned char *d = dst;
+	const unsigned char *s = src;
+	size_t i, j;
+
+	for (i = 0; i < n; i += 8) {
+		for (j = 1; j < 8 && i + j < n; ++j)
+			*d++ = (s[i + j] & 0x7f) | (s[i] >> (j - 1) & 1) << 7;
+	}
+	return d - (unsigned char *)dst;
+}
+
+/* like pack7scalar, but two groups at a time with SSE2 or NEON */
+static inline size_t
+pack7(void *dst, const void *src, size_t n)
+{
+	unsigned char *d = dst;
+	const unsigned char *s = src;
+#if defined(__SSE2__)
+	__m128i v;
+	int m;
+
+	/* the second load reads one byte past the groups */
+	for (; n >= 15; n -= 14, s += 14, d += 16) {
+		v = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)s), _mm_loadl_epi64((const __m128i *)(s + 7)));
+		v = _mm_slli_epi64(v, 8);
+		m = _mm_movemask_epi8(v);
+		_mm_storeu_si128((__m128i *)d, _mm_and_si128(v, _mm_set1_epi8(0x7f)));
+		d[0] = m >> 1 & 0x7f;
+		d[8] = m >> 9 & 0x7f;
+	}
+#elif defined(__ARM_NEON)
+	static const int8_t shift[16] = {0, -7, -6, -5, -4, -3, -2, -1, 0, -7, -6, -5, -4, -3, -2, -1};
+	uint8x16_t v;
+	uint64x2_t h;
+
+	for (; n >= 15; n -= 14, s += 14, d += 16) {
+		v = vcombine_u8(vld1_u8(s), vld1_u8(s + 7));
+		v = vreinterpretq_u8_u64(vshlq_n_u64(vreinterpretq_u64_u8(v), 8));
+		/* move each high bit to its position in the header, and add them up */
+		h = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(vshlq_u8(vandq_u8(v, vdupq_n_u8(0x80)), vld1q_s8(shift)))));
+		vst1q_u8(d, vandq_u8(v, vdupq_n_u8(0x7f)));
+		d[0] = vgetq_lane_u64(h, 0);
+		d[8] = vgetq_lane_u64(h, 1);
+	}
+#endif
+	return d - (unsigned char *)dst + pack7scalar(d, s, n);
+}
+
+/* like unpack7scalar, but two groups at a time with SSE2 or NEON */
+static inline size_t
+unpack7(void *dst, const void *src, size_t n)
+{
+	unsigned char *d = dst;
+	const unsigned char *s = src;
+#if defined(__SSE2__)
+	__m128i v, h, bit;
+
+	bit = _mm_set_epi8(64, 32, 16, 8, 4, 2, 1, 0, 64, 32, 16, 8, 4, 2, 1, 0);
+	/* each group is stored as 8 bytes, the last of which is overwritten by the next group */
+	for (; n >= 24; n -= 16, s += 16, d += 14) {
+		v = _mm_loadu_si128((const __m128i *)s);
+		/* broadcast the header byte to its group */
+		h = _mm_and_si128(v, _mm_set_epi32(0, 0xff, 0, 0xff));
+		h = _mm_or_si128(h, _mm_slli_epi64(h, 8));
+		h = _mm_or_si128(h, _mm_slli_epi64(h, 16));
+		h = _mm_or_si128(h, _mm_slli_epi64(h, 32));
+		h = _mm_cmpeq_epi8(_mm_and_si128(h, bit), bit);
+		v = _mm_or_si128(_mm_and_si128(v, _mm_set1_epi8(0x7f)), _mm_and_si128(h, _mm_set1_epi8(-128)));
+		v = _mm_srli_epi64(v, 8);
+		_mm_storel_epi64((__m128i *)d, v);
+		_mm_storel_epi64((__m128i *)(d + 7), _mm_unpackhi_epi64(v, v));
+	}
+#elif defined(__ARM_NEON)
+	static const uint8_t bits[16] = {0, 1, 2, 4, 8, 16, 32, 64, 0, 1, 2, 4, 8, 16, 32, 64};
+	uint8x16_t v, h, bit;
+	uint64x2_t w;
+
+	bit = vld1q_u8(bits);
+	for (; n >= 24; n -= 16, s += 16, d += 14) {
+		v = vld1q_u8(s);
+		h = vcombine_u8(vdup_n_u8(s[0]), vdup_n_u8(s[8]));
+		h = vceqq_u8(vandq_u8(h, bit), bit);
+		v = vorrq_u8(vandq_u8(v, vdupq_n_u8(0x7f)), vandq_u8(h, vdupq_n_u8(0x80)));
+		w = vshrq_n_u64(vreinterpretq_u64_u8(v), 8);
+		vst1_u8(d, vreinterpret_u8_u64(vget_low_u64(w)));
+		vst1_u8(d + 7, vreinterpret_u8_u64(vget_high_u64(w)));
+	}
+#endif
+	return d - (unsigned char *)dst + unpack7scalar(d, s, n);
+}
+
 #endif
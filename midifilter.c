@@ -0,0 +1,127 @@
+#include <stdlib.h>
+#include <string.h>
+#include "midifilter.h"
+
+static const struct {
+	const char *name;
+	unsigned char first, last;  /* status byte range */
+} types[] = {
+	{"note",      0x80, 0x9F},
+	{"keypress",  0xA0, 0xAF},
+	{"cc",        0xB0, 0xBF},
+	{"program",   0xC0, 0xCF},
+	{"chanpress", 0xD0, 0xDF},
+	{"bend",      0xE0, 0xEF},
+	{"sysex",     0xF0, 0xF0},
+	{"common",    0xF1, 0xF7},
+	{"qframe",    0xF1, 0xF1},
+	{"songpos",   0xF2, 0xF2},
+	{"songsel",   0xF3, 0xF3},
+	{"tune",      0xF6, 0xF6},
+	{"realtime",  0xF8, 0xFF},
+	{"clock",     0xF8, 0xF8},
+	{"start",     0xFA, 0xFA},
+	{"continue",  0xFB, 0xFB},
+	{"stop",      0xFC, 0xFC},
+	{"sensing",   0xFE, 0xFE},
+	{"reset",     0xFF, 0xFF},
+};
+
+static int
+parserange(const char *s, size_t len, int min, int max, int *lo, int *hi)
+{
+	char buf[16], *end;
+	long n;
+
+	if (len >= sizeof buf)
+		return -1;
+	memcpy(buf, s, len);
+	buf[len] = '\0';
+	n = strtol(buf, &end, 10);
+	if (end == buf || n < min || n > max)
+		return -1;
+	*lo = *hi = n;
+	if (*end == '-') {
+		s = end + 1;
+		n = strtol(s, &end, 10);
+		if (end == s || n < *lo || n > max)
+			return -1;
+		*hi = n;
+	}
+	return *end ? -1 : 0;
+}
+
+/*
+Builds the status byte table from a comma-separated list of message
+types to drop, and of ch=, note=, and cc= ranges to pass. Returns -1
+if the list is invalid.
+*/
+int
+midifilterparse(struct midifilter *f, const char *spec)
+{
+	const char *end, *val;
+	size_t len, i;
+	int lo, hi, c;
+
+	memset(f, 0, sizeof *f);
+	for (; *spec; spec = *end ? end + 1 : end) {
+		end = strchr(spec, ',');
+		if (!end)
+			end = spec + strlen(spec);
+		val = memchr(spec, '=', end - spec);
+		if (!val) {
+			len = end - spec;
+			for (i = 0; i < sizeof types / sizeof *types; ++i) {
+				if (strlen(types[i].name) == len && memcmp(types[i].name, spec, len) == 0)
+					break;
+			}
+			if (i == sizeof types / sizeof *types)
+				return -1;
+			for (c = types[i].first; c <= types[i].last; ++c)
+				f->tab[c] |= MIDIFILTER_DROP;
+			continue;
+		}
+		len = val++ - spec;
+		if (len == 2 && memcmp(spec, "ch", 2) == 0) {
+			if (parserange(val, end - val, 1, 16, &lo, &hi) != 0)
+				return -1;
+			for (c = 0x80; c < 0xF0; ++c) {
+				if ((c & 0xF) + 1 < lo || (c & 0xF) + 1 > hi)
+					f->tab[c] |= MIDIFILTER_DROP;
+			}
+		} else if (len == 4 && memcmp(spec, "note", 4) == 0) {
+			if (parserange(val, end - val, 0, 127, &lo, &hi) != 0)
+				return -1;
+			for (c = 0; c < 128; ++c)
+				f->notes[c] |= c < lo || c > hi;
+			for (c = 0x80; c < 0xB0; ++c)
+				f->tab[c] |= MIDIFILTER_NOTE;
+		} else if (len == 2 && memcmp(spec, "cc", 2) == 0) {
+			if (parserange(val, end - val, 0, 127, &lo, &hi) != 0)
+				return -1;
+			for (c = 0; c < 128; ++c)
+				f->ctls[c] |= c < lo || c > hi;
+			for (c = 0xB0; c < 0xC0; ++c)
+				f->tab[c] |= MIDIFILTER_CTL;
+		} else {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* returns non-zero if the message starting with status byte m[0] is dropped */
+int
+midifiltered(const struct midifilter *f, const unsigned char *m)
+{
+	int t;
+
+	t = f->tab[m[0]];
+	if (t & MIDIFILTER_DROP)
+		return 1;
+	if (t & MIDIFILTER_NOTE)
+		return f->notes[m[1]];
+	if (t & MIDIFILTER_CTL)
+		return f->ctls[m[1]];
+	return 0;
+}
@@ -0,0 +1,19 @@
+#ifndef MIDIFILTER_H
+#define MIDIFILTER_H
+
+/* midifilter tab entries */
+enum {
+	MIDIFILTER_DROP = 1,
+	MIDIFILTER_NOTE = 2,  /* check notes */
+	MIDIFILTER_CTL  = 4,  /* check ctls */
+};
+
+struct midifilter {
+	unsigned char tab[256];  /* indexed by status byte */
+	unsigned char notes[128], ctls[128];  /* non-zero to drop */
+};
+
+int midifilterparse(struct midifilter *, const char *);
+int midifiltered(const struct midifilter *, const unsigned char *);
+
+#endif
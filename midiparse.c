@@ -0,0 +1,139 @@
+#include <stdint.h>
+#include <string.h>
+#include "midiparse.h"
+
+#define S MIDI_STATUS
+#define C MIDI_COMMON
+#define R MIDI_REALTIME
+#define X16(x) x, x, x, x, x, x, x, x, x, x, x, x, x, x, x, x
+
+const unsigned char miditab[256] = {
+	/* data bytes */
+	X16(0), X16(0), X16(0), X16(0), X16(0), X16(0), X16(0), X16(0),
+	/* channel voice */
+	X16(S|3), X16(S|3), X16(S|3), X16(S|3), X16(S|2), X16(S|2), X16(S|3),
+	/* system common */
+	S|C|MIDI_SYSEX, S|C|2, S|C|3, S|C|2, S|C|MIDI_INVALID, S|C|MIDI_INVALID, S|C|1, S|C|MIDI_EOX,
+	/* system real-time */
+	S|R|1, S|R|MIDI_INVALID, S|R|1, S|R|1, S|R|1, S|R|MIDI_INVALID, S|R|1, S|R|1,
+};
+
+/* returns the first byte in [pos, end) with the high bit set, or end */
+const unsigned char *
+midifindstatus(const unsigned char *pos, const unsigned char *end)
+{
+	uint_least64_t w;
+
+	for (; end - pos >= 8; pos += 8) {
+		memcpy(&w, pos, 8);
+		if (w & 0x8080808080808080)
+			break;
+	}
+	for (; pos != end; ++pos) {
+		if (*pos & 0x80)
+			break;
+	}
+	return pos;
+}
+
+/*
+Parses at most one message from buf, returning the number of bytes
+consumed. If a complete message (or a chunk of a system exclusive
+message) was found, m->len is non-zero and m->data points to either
+the parser state or into buf.
+*/
+size_t
+midiparse(struct midiparser *p, const unsigned char *buf, size_t len, struct midimsg *m)
+{
+	const unsigned char *pos, *end, *start;
+	int t;
+
+	pos = buf;
+	end = buf + len;
+	m->len = 0;
+	m->flags = 0;
+	while (pos != end) {
+		if (p->sysex) {
+			start = pos;
+		sysex:
+			pos = midifindstatus(pos, end);
+			if (pos != end) {
+				t = miditab[*pos];
+				if (t & MIDI_EOX) {
+					++pos;
+					m->flags = MIDIMSG_EOX;
+					p->sysex = 0;
+				} else if (!(t & MIDI_REALTIME)) {
+					p->sysex = 0;  /* unterminated */
+				}
+			}
+			if (pos != start) {
+				m->data = start;
+				m->len = pos - start;
+				m->flags |= MIDIMSG_SYSEX;
+				break;
+			}
+			/* real-time or status byte right at chunk boundary */
+		} else if (p->pos == 0) {
+			pos = midifindstatus(pos, end);
+			if (pos == end)
+				break;
+		}
+		t = miditab[*pos];
+		if (!(t & MIDI_STATUS)) {
+			p->msg[p->pos++] = *pos++;
+		} else if (t & MIDI_REALTIME) {
+			if (t & MIDI_INVALID) {
+				++pos;
+				continue;
+			}
+			m->data = pos++;
+			m->len = 1;
+			break;
+		} else if (t & MIDI_SYSEX) {
+			p->pos = 0;
+			p->sysex = 1;
+			start = pos++;
+			goto sysex;
+		} else {
+			p->msg[0] = *pos++;
+			p->len = t & MIDI_LEN;
+			p->pos = p->len ? 1 : 0;  /* invalid status or stray EOX */
+			if (!p->pos)
+				continue;
+		}
+		if (p->pos == p->len) {
+			m->data = p->msg;
+			m->len = p->len;
+			p->pos = miditab[p->msg[0]] & MIDI_COMMON ? 0 : 1;
+			break;
+		}
+	}
+	return pos - buf;
+}
+
+/*
+Removes the status byte of the complete message m if it is the running
+status *last, and updates *last. System exclusive and system common
+messages cancel running status, and real-time messages and system
+exclusive data leave it alone. Returns the new length of m.
+*/
+size_t
+midirunstatus(unsigned char *last, unsigned char *m, size_t len)
+{
+	int t;
+
+	t = miditab[m[0]];
+	if (!(t & MIDI_STATUS) || t & MIDI_REALTIME)
+		return len;
+	if (t & MIDI_COMMON) {
+		*last = 0;
+		return len;
+	}
+	if (*last == m[0]) {
+		memmove(m, m + 1, --len);
+		return len;
+	}
+	*last = m[0];
+	return len;
+}
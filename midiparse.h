@@ -0,0 +1,41 @@
+#ifndef MIDIPARSE_H
+#define MIDIPARSE_H
+
+#include <stddef.h>
+
+/* miditab entries */
+enum {
+	MIDI_LEN      = 0x03,  /* message length, including status */
+	MIDI_REALTIME = 0x04,
+	MIDI_COMMON   = 0x08,  /* cancels running status */
+	MIDI_SYSEX    = 0x10,
+	MIDI_EOX      = 0x20,
+	MIDI_INVALID  = 0x40,
+	MIDI_STATUS   = 0x80,
+};
+
+/* midimsg flags */
+enum {
+	MIDIMSG_SYSEX = 1,  /* data is a chunk of a system exclusive message */
+	MIDIMSG_EOX   = 2,  /* chunk ends with 0xF7 */
+};
+
+struct midiparser {
+	unsigned char msg[3];
+	unsigned char pos, len;
+	unsigned char sysex;
+};
+
+struct midimsg {
+	const unsigned char *data;
+	size_t len;
+	int flags;
+};
+
+extern const unsigned char miditab[256];
+
+size_t midiparse(struct midiparser *, const unsigned char *, size_t, struct midimsg *);
+const unsigned char *midifindstatus(const unsigned char *, const unsigned char *);
+size_t midirunstatus(unsigned char *, unsigned char *, size_t);
+
+#endif
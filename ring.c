@@ -0,0 +1,134 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "fatal.h"
+#include "ring.h"
+
+void
+ringinit(struct ring *r, size_t n)
+{
+	size_t i, size;
+
+	for (size = 1; size < n; size *= 2)
+		;
+	r->slot = calloc(size, sizeof r->slot[0]);
+	if (!r->slot)
+		fatal("calloc:");
+	for (i = 0; i < size; ++i)
+		atomic_init(&r->slot[i].seq, i);
+	r->mask = size - 1;
+	atomic_init(&r->head, 0);
+	r->tail = 0;
+	atomic_init(&r->waiting, 0);
+	r->wakefd = -1;
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->cond, NULL);
+}
+
+static void
+ringwake(struct ring *r)
+{
+	uint64_t one;
+
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&r->waiting, memory_order_relaxed)) {
+		pthread_mutex_lock(&r->lock);
+		atomic_store_explicit(&r->waiting, 0, memory_order_relaxed);
+		pthread_cond_broadcast(&r->cond);
+		pthread_mutex_unlock(&r->lock);
+		if (r->wakefd != -1) {
+			one = 1;
+			if (write(r->wakefd, &one, sizeof one) < 0)
+				fatal("write:");
+		}
+	}
+}
+
+/* called by the producer only; returns 0 if the ring is full */
+int
+ringput(struct ring *r, const unsigned char *data, size_t len)
+{
+	struct ringslot *s;
+
+	s = &r->slot[r->tail & r->mask];
+	if (atomic_load_explicit(&s->seq, memory_order_acquire) != r->tail)
+		return 0;
+	s->len = len;
+	memcpy(s->data, data, len);
+	atomic_store_explicit(&s->seq, r->tail + 1, memory_order_release);
+	++r->tail;
+	ringwake(r);
+	return 1;
+}
+
+/* returns the length of the message copied to data, or 0 if the ring is empty */
+size_t
+ringget(struct ring *r, unsigned char *data)
+{
+	struct ringslot *s;
+	size_t pos, seq, len;
+
+	pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+	for (;;) {
+		s = &r->slot[pos & r->mask];
+		seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+		if (seq == pos + 1) {
+			if (atomic_compare_exchange_weak_explicit(&r->head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+				break;
+		} else if (seq == pos) {
+			return 0;
+		} else {
+			pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+		}
+	}
+	len = s->len;
+	memcpy(data, s->data, len);
+	atomic_store_explicit(&s->seq, pos + r->mask + 1, memory_order_release);
+	ringwake(r);
+	return len;
+}
+
+/* called by the producer only */
+size_t
+ringcount(struct ring *r)
+{
+	return r->tail - atomic_load_explicit(&r->head, memory_order_relaxed);
+}
+
+int
+ringempty(struct ring *r)
+{
+	size_t pos;
+
+	pos = atomic_load(&r->head);
+	return atomic_load(&r->slot[pos & r->mask].seq) != pos + 1;
+}
+
+int
+ringfull(struct ring *r)
+{
+	return atomic_load(&r->slot[r->tail & r->mask].seq) != r->tail;
+}
+
+/* sleeps while cond(r) holds */
+void
+ringwait(struct ring *r, int (*cond)(struct ring *))
+{
+	pthread_mutex_lock(&r->lock);
+	atomic_store(&r->waiting, 1);
+	if (cond(r))
+		pthread_cond_wait(&r->cond, &r->lock);
+	pthread_mutex_unlock(&r->lock);
+}
+
+/*
+Called by a consumer before it sleeps on wakefd. Returns 0 if there
+are messages to consume, in which case it should not sleep.
+*/
+int
+ringidle(struct ring *r)
+{
+	atomic_store(&r->waiting, 1);
+	return ringempty(r);
+}
@@ -0,0 +1,45 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <pthread.h>
+
+enum {
+	RINGDATA = 15,
+};
+
+struct ringslot {
+	atomic_size_t seq;
+	unsigned char len;
+	unsigned char data[RINGDATA];
+};
+
+/*
+Bounded queue of short messages with a single producer. Slots are
+claimed with per-slot sequence numbers, so besides the consumer, the
+producer may also take messages from the head to drop them.
+*/
+struct ring {
+	struct ringslot *slot;
+	size_t mask;
+	char pad0[64];
+	atomic_size_t head;
+	char pad1[64];
+	size_t tail;
+	atomic_int waiting;
+	int wakefd;  /* eventfd written when the consumer is woken, or -1 */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+void ringinit(struct ring *, size_t);
+int ringput(struct ring *, const unsigned char *, size_t);
+size_t ringget(struct ring *, unsigned char *);
+size_t ringcount(struct ring *);
+int ringempty(struct ring *);
+int ringfull(struct ring *);
+void ringwait(struct ring *, int (*)(struct ring *));
+int ringidle(struct ring *);
+
+#endif
@@ -0,0 +1,164 @@
+#define _POSIX_C_SOURCE 200809L
+#include <time.h>
+#include <alsa/asoundlib.h>
+#include "fatal.h"
+#include "midiparse.h"
+#include "seqmidi.h"
+
+/*
+Fills in the type and data of a sequencer event from a MIDI message,
+without going through the byte-at-a-time snd_midi_event_encode.
+Returns 0 if the message has no sequencer equivalent.
+*/
+int
+seqencode(snd_seq_event_t *evt, const struct midimsg *m)
+{
+	const unsigned char *d;
+
+	d = m->data;
+	if (m->flags & MIDIMSG_SYSEX) {
+		snd_seq_ev_set_sysex(evt, m->len, (void *)d);
+		return 1;
+	}
+	snd_seq_ev_set_fixed(evt);
+	switch (d[0] >> 4) {
+	case 0x8: evt->type = SND_SEQ_EVENT_NOTEOFF; goto note;
+	case 0x9: evt->type = SND_SEQ_EVENT_NOTEON; goto note;
+	case 0xA: evt->type = SND_SEQ_EVENT_KEYPRESS; goto note;
+	note:
+		evt->data.note.channel = d[0] & 0xF;
+		evt->data.note.note = d[1];
+		evt->data.note.velocity = d[2];
+		return 1;
+	case 0xB:
+		evt->type = SND_SEQ_EVENT_CONTROLLER;
+		evt->data.control.param = d[1];
+		evt->data.control.value = d[2];
+		break;
+	case 0xC:
+		evt->type = SND_SEQ_EVENT_PGMCHANGE;
+		evt->data.control.value = d[1];
+		break;
+	case 0xD:
+		evt->type = SND_SEQ_EVENT_CHANPRESS;
+		evt->data.control.value = d[1];
+		break;
+	case 0xE:
+		evt->type = SND_SEQ_EVENT_PITCHBEND;
+		evt->data.control.value = (d[1] | d[2] << 7) - 8192;
+		break;
+	case 0xF:
+		switch (d[0]) {
+		case 0xF1: evt->type = SND_SEQ_EVENT_QFRAME; evt->data.control.value = d[1]; break;
+		case 0xF2: evt->type = SND_SEQ_EVENT_SONGPOS; evt->data.control.value = d[1] | d[2] << 7; break;
+		case 0xF3: evt->type = SND_SEQ_EVENT_SONGSEL; evt->data.control.value = d[1]; break;
+		case 0xF6: evt->type = SND_SEQ_EVENT_TUNE_REQUEST; break;
+		case 0xF8: evt->type = SND_SEQ_EVENT_CLOCK; break;
+		case 0xFA: evt->type = SND_SEQ_EVENT_START; break;
+		case 0xFB: evt->type = SND_SEQ_EVENT_CONTINUE; break;
+		case 0xFC: evt->type = SND_SEQ_EVENT_STOP; break;
+		case 0xFE: evt->type = SND_SEQ_EVENT_SENSING; break;
+		case 0xFF: evt->type = SND_SEQ_EVENT_RESET; break;
+		default: return 0;
+		}
+		return 1;
+	default:
+		return 0;
+	}
+	evt->data.control.channel = d[0] & 0xF;
+	return 1;
+}
+
+/* status byte of each MIDI event type, without the channel */
+const unsigned char seqtypestatus[256] = {
+	[SND_SEQ_EVENT_NOTE] = 0x90,
+	[SND_SEQ_EVENT_NOTEON] = 0x90,
+	[SND_SEQ_EVENT_NOTEOFF] = 0x80,
+	[SND_SEQ_EVENT_KEYPRESS] = 0xA0,
+	[SND_SEQ_EVENT_CONTROLLER] = 0xB0,
+	[SND_SEQ_EVENT_CONTROL14] = 0xB0,
+	[SND_SEQ_EVENT_NONREGPARAM] = 0xB0,
+	[SND_SEQ_EVENT_REGPARAM] = 0xB0,
+	[SND_SEQ_EVENT_PGMCHANGE] = 0xC0,
+	[SND_SEQ_EVENT_CHANPRESS] = 0xD0,
+	[SND_SEQ_EVENT_PITCHBEND] = 0xE0,
+	[SND_SEQ_EVENT_SYSEX] = 0xF0,
+	[SND_SEQ_EVENT_QFRAME] = 0xF1,
+	[SND_SEQ_EVENT_SONGPOS] = 0xF2,
+	[SND_SEQ_EVENT_SONGSEL] = 0xF3,
+	[SND_SEQ_EVENT_TUNE_REQUEST] = 0xF6,
+	[SND_SEQ_EVENT_CLOCK] = 0xF8,
+	[SND_SEQ_EVENT_START] = 0xFA,
+	[SND_SEQ_EVENT_CONTINUE] = 0xFB,
+	[SND_SEQ_EVENT_STOP] = 0xFC,
+	[SND_SEQ_EVENT_SENSING] = 0xFE,
+	[SND_SEQ_EVENT_RESET] = 0xFF,
+};
+
+/*
+Stores the status byte and, for notes and controllers, the first data
+byte that evt decodes to. Returns 0 if it is not a MIDI event.
+*/
+int
+seqstatus(const snd_seq_event_t *evt, unsigned char m[static 2])
+{
+	m[0] = seqtypestatus[evt->type];
+	m[1] = 0;
+	switch (m[0]) {
+	case 0:
+		return 0;
+	case 0x80:
+	case 0x90:
+	case 0xA0:
+		m[0] |= evt->data.note.channel & 0xF;
+		m[1] = evt->data.note.note & 0x7F;
+		break;
+	case 0xB0:
+		switch (evt->type) {
+		case SND_SEQ_EVENT_NONREGPARAM: m[1] = 99; break;
+		case SND_SEQ_EVENT_REGPARAM: m[1] = 101; break;
+		default: m[1] = evt->data.control.param & 0x7F; break;
+		}
+		/* fallthrough */
+	case 0xC0:
+	case 0xD0:
+	case 0xE0:
+		m[0] |= evt->data.control.channel & 0xF;
+		break;
+	}
+	return 1;
+}
+
+long long
+monotime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+/*
+Returns the monotonic clock time at which the real time of a running
+queue was 0, so that the queue time can be extrapolated as monotime()
+minus it without asking the sequencer.
+*/
+long long
+seqqueuebase(snd_seq_t *seq, int queue)
+{
+	snd_seq_queue_status_t *status;
+	const snd_seq_real_time_t *rt;
+	long long base;
+	int err;
+
+	err = snd_seq_queue_status_malloc(&status);
+	if (err)
+		fatal("snd_seq_queue_status_malloc: %s", snd_strerror(err));
+	err = snd_seq_get_queue_status(seq, queue, status);
+	if (err)
+		fatal("snd_seq_get_queue_status: %s", snd_strerror(err));
+	rt = snd_seq_queue_status_get_real_time(status);
+	base = monotime() - (rt->tv_sec * 1000000000ll + rt->tv_nsec);
+	snd_seq_queue_status_free(status);
+	return base;
+}
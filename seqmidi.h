@@ -0,0 +1,13 @@
+#ifndef SEQMIDI_H
+#define SEQMIDI_H
+
+struct midimsg;
+
+extern const unsigned char seqtypestatus[256];
+
+int seqencode(snd_seq_event_t *, const struct midimsg *);
+int seqstatus(const snd_seq_event_t *, unsigned char [static 2]);
+long long monotime(void);
+long long seqqueuebase(snd_seq_t *, int);
+
+#endif
@@ -0,0 +1,309 @@
+/* SPDX-License-Identifier: Unlicense */
+#ifndef SHMRING_H
+#define SHMRING_H
+
+/*
+Byte stream between two processes through a ring buffer in a memfd,
+as used by alsaseqio -m in place of a pipe. There is one producer and
+one consumer. Neither makes a system call while the ring is neither
+empty nor full; a side that has to wait sleeps on a futex, and the
+other side only wakes it if it has said so.
+
+Either side may close the ring. The consumer then reads what remains
+followed by end of file, and the producer's writes fail.
+
+A side that dies cannot close the ring itself. If the processes of
+both sides are recorded with shmringown, a waiting side checks every
+SHMRINGPOLL milliseconds whether its peer has exited, and closes the
+ring if so, as a pipe would report end of file or EPIPE.
+
+memfd_create needs _GNU_SOURCE to be defined before any include.
+*/
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+enum {
+	SHMRINGSIZE = 65536,  /* default data size */
+	SHMRINGREAD = 0,
+	SHMRINGWRITE = 1,
+	SHMRINGPOLL = 100,  /* milliseconds between checks that the peer lives */
+};
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+struct shmring {
+	/* advanced by the producer */
+	atomic_uint tail;
+	atomic_uint rwake;  /* futex of a waiting consumer */
+	atomic_uint rwait;
+	char pad0[52];
+	/* advanced by the consumer */
+	atomic_uint head;
+	atomic_uint wwake;  /* futex of a waiting producer */
+	atomic_uint wwait;
+	char pad1[52];
+	atomic_uint closed;
+	uint32_t size;  /* of data, a power of two */
+	atomic_int pid[2];  /* of the consumer and producer, or 0 if unknown */
+	char pad2[48];
+	unsigned char data[];
+};
+
+static inline long
+shmringfutex(atomic_uint *word, int op, unsigned val, const struct timespec *ts)
+{
+	return syscall(SYS_futex, (uint32_t *)word, op, val, ts, NULL, 0);
+}
+
+/* maps a ring created by shmringcreate; returns NULL on error */
+static inline struct shmring *
+shmringmap(int fd)
+{
+	struct shmring *r;
+	struct stat st;
+	void *map;
+
+	if (fstat(fd, &st) != 0)
+		return NULL;
+	if (st.st_size <= (off_t)sizeof *r) {
+		errno = EINVAL;
+		return NULL;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+	r = map;
+	if (r->size == 0 || r->size & (r->size - 1) || r->size > st.st_size - sizeof *r) {
+		munmap(map, st.st_size);
+		errno = EINVAL;
+		return NULL;
+	}
+	return r;
+}
+
+/*
+Creates a ring with at least size bytes of data in a new memfd, and
+stores the descriptor, which has close-on-exec set, in *fd. Returns
+NULL on error.
+*/
+static inline struct shmring *
+shmringcreate(size_t size, int *fd)
+{
+	struct shmring *r;
+	size_t n;
+
+	for (n = 64; n < size && n <= UINT32_MAX / 4; n *= 2)
+		;
+	*fd = memfd_create("shmring", MFD_CLOEXEC);
+	if (*fd < 0)
+		return NULL;
+	if (ftruncate(*fd, sizeof *r + n) != 0)
+		goto err;
+	/* the memfd is zero filled, so all that is left is the size */
+	r = mmap(NULL, sizeof *r + n, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+	if (r == MAP_FAILED)
+		goto err;
+	r->size = n;
+	return r;
+
+err:
+	close(*fd);
+	*fd = -1;
+	return NULL;
+}
+
+/*
+Wakes a waiting peer after an update to head or tail. Only the first
+update after the peer started waiting makes a system call.
+*/
+static inline void
+shmringwake(atomic_uint *wait, atomic_uint *wake)
+{
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(wait, memory_order_relaxed) && atomic_exchange(wait, 0)) {
+		atomic_fetch_add_explicit(wake, 1, memory_order_relaxed);
+		shmringfutex(wake, FUTEX_WAKE, 1, NULL);
+	}
+}
+
+static inline void
+shmringclose(struct shmring *r)
+{
+	atomic_store(&r->closed, 1);
+	atomic_fetch_add(&r->rwake, 1);
+	atomic_fetch_add(&r->wwake, 1);
+	shmringfutex(&r->rwake, FUTEX_WAKE, 1, NULL);
+	shmringfutex(&r->wwake, FUTEX_WAKE, 1, NULL);
+}
+
+/* records pid as the process on side dir, SHMRINGREAD or SHMRINGWRITE */
+static inline void
+shmringown(struct shmring *r, int dir, pid_t pid)
+{
+	atomic_store(&r->pid[dir], pid);
+}
+
+/* whether the peer of side dir is known to have exited, even if not yet reaped */
+static inline int
+shmringgone(struct shmring *r, int dir)
+{
+	struct pollfd pfd;
+	pid_t pid;
+	int ret;
+
+	pid = atomic_load(&r->pid[!dir]);
+	if (pid <= 0)
+		return 0;
+	pfd.fd = syscall(SYS_pidfd_open, pid, 0);
+	if (pfd.fd < 0) {
+		if (errno == ENOSYS)
+			return kill(pid, 0) != 0 && errno == ESRCH;
+		return errno == ESRCH;
+	}
+	pfd.events = POLLIN;
+	ret = poll(&pfd, 1, 0);
+	close(pfd.fd);
+	return ret > 0;
+}
+
+/* copies up to len bytes into the ring without blocking; returns the number copied */
+static inline size_t
+shmringput(struct shmring *r, const void *buf, size_t len)
+{
+	uint32_t head, tail, off, n;
+
+	tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	head = atomic_load_explicit(&r->head, memory_order_acquire);
+	if (len > r->size - (tail - head))
+		len = r->size - (tail - head);
+	if (len == 0)
+		return 0;
+	off = tail & (r->size - 1);
+	n = r->size - off < len ? r->size - off : len;
+	memcpy(r->data + off, buf, n);
+	memcpy(r->data, (const unsigned char *)buf + n, len - n);
+	atomic_store_explicit(&r->tail, tail + len, memory_order_release);
+	shmringwake(&r->rwait, &r->rwake);
+	return len;
+}
+
+/* copies up to len bytes out of the ring without blocking; returns the number copied */
+static inline size_t
+shmringget(struct shmring *r, void *buf, size_t len)
+{
+	uint32_t head, tail, off, n;
+
+	head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+	if (len > tail - head)
+		len = tail - head;
+	if (len == 0)
+		return 0;
+	off = head & (r->size - 1);
+	n = r->size - off < len ? r->size - off : len;
+	memcpy(buf, r->data + off, n);
+	memcpy((unsigned char *)buf + n, r->data, len - n);
+	atomic_store_explicit(&r->head, head + len, memory_order_release);
+	shmringwake(&r->wwait, &r->wwake);
+	return len;
+}
+
+/*
+Waits until the ring can be read from (dir is SHMRINGREAD) or written
+to (SHMRINGWRITE), or it is closed, for at most timeout milliseconds,
+or indefinitely if timeout is -1. Returns 0 on timeout. A peer that
+has exited closes the ring.
+*/
+static inline int
+shmringwait(struct shmring *r, int dir, int timeout)
+{
+	struct timespec ts;
+	atomic_uint *wait, *wake;
+	unsigned seq;
+	uint32_t used;
+	int ready, slice;
+
+	wait = dir == SHMRINGREAD ? &r->rwait : &r->wwait;
+	wake = dir == SHMRINGREAD ? &r->rwake : &r->wwake;
+	for (;;) {
+		seq = atomic_load(wake);
+		atomic_store(wait, 1);
+		atomic_thread_fence(memory_order_seq_cst);
+		used = atomic_load(&r->tail) - atomic_load(&r->head);
+		ready = atomic_load(&r->closed) || (dir == SHMRINGREAD ? used > 0 : used < r->size);
+		if (ready || timeout == 0)
+			break;
+		slice = timeout == -1 || timeout > SHMRINGPOLL ? SHMRINGPOLL : timeout;
+		ts.tv_sec = slice / 1000;
+		ts.tv_nsec = slice % 1000 * 1000000L;
+		/* a wakeup after seq was loaded makes this return at once */
+		if (shmringfutex(wake, FUTEX_WAIT, seq, &ts) != 0 && errno == ETIMEDOUT) {
+			if (shmringgone(r, dir))
+				shmringclose(r);
+			else if (timeout != -1)
+				timeout -= slice;
+		}
+	}
+	atomic_store_explicit(wait, 0, memory_order_relaxed);
+	return ready;
+}
+
+/*
+Reads at least one byte, waiting if the ring is empty. Returns the
+number of bytes read, or 0 once the ring is closed and empty.
+*/
+static inline size_t
+shmringread(struct shmring *r, void *buf, size_t len)
+{
+	size_t n;
+
+	while ((n = shmringget(r, buf, len)) == 0 && len > 0) {
+		if (atomic_load(&r->closed)) {
+			/* data written just before closing */
+			return shmringget(r, buf, len);
+		}
+		shmringwait(r, SHMRINGREAD, -1);
+	}
+	return n;
+}
+
+/* writes all of buf, waiting while the ring is full; returns -1 if it is closed */
+static inline int
+shmringwrite(struct shmring *r, const void *buf, size_t len)
+{
+	const unsigned char *pos;
+	size_t n;
+
+	pos = buf;
+	while (len > 0) {
+		if (atomic_load(&r->closed)) {
+			errno = EPIPE;
+			return -1;
+		}
+		n = shmringput(r, pos, len);
+		if (n == 0) {
+			shmringwait(r, SHMRINGWRITE, -1);
+			continue;
+		}
+		pos += n;
+		len -= n;
+	}
+	return 0;
+}
+
+#endif
@@ -0,0 +1,569 @@
+#define _POSIX_C_SOURCE 200809L
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "fatal.h"
+#include "intpack.h"
+#include "midiparse.h"
+#include "smf.h"
+
+enum {
+	IDXHDR = 36,    /* magic, version, tracks, interval, file size, mtime, points, record length */
+	IDXTRACK = 13,  /* offset (le32), tick (le64), running status */
+	IDXSTATE = 16 * 128 + 16 + 16 + 16 * 2,
+};
+
+static unsigned long
+readvlq(const struct smf *f, const unsigned char **pos, const unsigned char *end)
+{
+	uint_least32_t v;
+	size_t len;
+
+	len = getvlq(*pos, end - *pos, &v);
+	if (len == 0)
+		fatal("%s: invalid variable-length quantity", f->name);
+	*pos += len;
+	return v;
+}
+
+/*
+Parses the event at the track cursor, then the delta time of the next
+one. Returns 0 at the end of the track. Running status is kept across
+system exclusive and meta events, which some files rely on.
+*/
+static int
+readevent(const struct smf *f, struct smftrack *t, struct smfevent *e)
+{
+	const unsigned char *pos, *end;
+	size_t len;
+	int s;
+
+	pos = t->pos;
+	end = t->end;
+	e->tick = t->tick;
+	e->meta = 0;
+	s = *pos;
+	if (s < 0x80) {
+		s = t->runstatus;
+		if (s == 0)
+			fatal("%s: data byte without running status", f->name);
+	} else {
+		++pos;
+	}
+	e->type = s;
+	if (s < 0xF0) {
+		t->runstatus = s;
+		len = (miditab[s] & MIDI_LEN) - 1;
+		if ((size_t)(end - pos) < len)
+			fatal("%s: truncated track", f->name);
+		e->msg[0] = s;
+		memcpy(e->msg + 1, pos, len);
+		e->data = e->msg;
+		e->len = len + 1;
+		pos += len;
+	} else {
+		if (s == 0xFF) {
+			if (pos == end)
+				fatal("%s: truncated track", f->name);
+			e->meta = *pos++;
+		} else if (s != 0xF0 && s != 0xF7) {
+			fatal("%s: invalid event type 0x%02X", f->name, s);
+		}
+		len = readvlq(f, &pos, end);
+		if ((size_t)(end - pos) < len)
+			fatal("%s: truncated track", f->name);
+		e->data = pos;
+		e->len = len;
+		pos += len;
+		if (s == 0xFF && e->meta == 0x2F)
+			pos = end;  /* end of track */
+	}
+	t->pos = pos;
+	if (pos == end)
+		return 0;
+	t->tick += readvlq(f, &t->pos, end);
+	if (t->pos == end)
+		fatal("%s: truncated track", f->name);
+	return 1;
+}
+
+static void
+addtempo(struct smf *f, unsigned long long tick, unsigned long tempo)
+{
+	struct smftempo *tm;
+	size_t i;
+
+	/* grow at powers of two */
+	if (f->ntempo == 0 || (f->ntempo >= 16 && (f->ntempo & (f->ntempo - 1)) == 0)) {
+		f->tempo = realloc(f->tempo, (f->ntempo ? f->ntempo * 2 : 16) * sizeof *f->tempo);
+		if (!f->tempo)
+			fatal("realloc:");
+	}
+	/* keep in order, after earlier changes at the same tick */
+	for (i = f->ntempo; i > 0 && f->tempo[i - 1].tick > tick; --i)
+		;
+	tm = &f->tempo[i];
+	memmove(tm + 1, tm, (f->ntempo - i) * sizeof *tm);
+	tm->tick = tick;
+	tm->tempo = tempo;
+	++f->ntempo;
+}
+
+/*
+Collects the tempo changes and computes their times. In format 1 files
+they are in the first track, so the others are not scanned.
+*/
+static void
+tempomap(struct smf *f)
+{
+	struct smftrack t;
+	struct smfevent e;
+	struct smftempo *tm;
+	int i, n, more;
+
+	addtempo(f, 0, 500000);
+	n = f->format == 1 && f->ntracks > 0 ? 1 : f->ntracks;
+	for (i = 0; i < n; ++i) {
+		t = f->tracks[i];
+		more = t.pos != t.end;
+		while (more) {
+			more = readevent(f, &t, &e);
+			if (e.type == 0xFF && e.meta == 0x51 && e.len == 3)
+				addtempo(f, e.tick, getbe24(e.data));
+		}
+	}
+	for (tm = f->tempo + 1; tm < f->tempo + f->ntempo; ++tm)
+		tm->time = tm[-1].time + (tm->tick - tm[-1].tick) * tm[-1].tempo * 1000 / f->division;
+}
+
+/* nanoseconds per num/den ticks for SMPTE timing */
+static void
+smpte(const struct smf *f, unsigned long long *num, unsigned long long *den)
+{
+	int fps;
+
+	/* frames per second, and ticks per frame */
+	fps = 256 - (f->division >> 8);
+	*num = 1000000000;
+	*den = fps * (f->division & 0xff);
+	if (fps == 29) {
+		*num *= 1001;
+		*den = 30000 * (f->division & 0xff);
+	}
+}
+
+static unsigned long long
+ticktime(struct smf *f, unsigned long long tick)
+{
+	const struct smftempo *tm;
+	unsigned long long num, den;
+
+	if (f->division & 0x8000) {
+		smpte(f, &num, &den);
+		return tick / den * num + tick % den * num / den;
+	}
+	while (f->curtempo + 1 < f->ntempo && f->tempo[f->curtempo + 1].tick <= tick)
+		++f->curtempo;
+	tm = &f->tempo[f->curtempo];
+	return tm->time + (tick - tm->tick) * tm->tempo * 1000 / f->division;
+}
+
+static int
+heapless(const struct smf *f, int a, int b)
+{
+	const struct smftrack *ta, *tb;
+
+	ta = &f->tracks[f->heap[a]];
+	tb = &f->tracks[f->heap[b]];
+	return ta->tick < tb->tick || (ta->tick == tb->tick && f->heap[a] < f->heap[b]);
+}
+
+static void
+heapswap(struct smf *f, int a, int b)
+{
+	int t;
+
+	t = f->heap[a];
+	f->heap[a] = f->heap[b];
+	f->heap[b] = t;
+}
+
+static void
+siftdown(struct smf *f, int i)
+{
+	int c;
+
+	for (; (c = 2 * i + 1) < f->nheap; i = c) {
+		if (c + 1 < f->nheap && heapless(f, c + 1, c))
+			++c;
+		if (!heapless(f, c, i))
+			break;
+		heapswap(f, i, c);
+	}
+}
+
+static void
+buildheap(struct smf *f)
+{
+	int i;
+
+	for (i = f->nheap / 2 - 1; i >= 0; --i)
+		siftdown(f, i);
+}
+
+/*
+Maps the file and sets up a cursor for each track, ordered by the time
+of their next event. Events are parsed as they are taken by smfnext.
+*/
+void
+smfopen(struct smf *f, const char *name)
+{
+	struct stat st;
+	const unsigned char *pos, *end;
+	unsigned long len;
+	int fd, i;
+
+	memset(f, 0, sizeof *f);
+	f->name = name;
+	fd = open(name, O_RDONLY);
+	if (fd < 0)
+		fatal("open %s:", name);
+	if (fstat(fd, &st) != 0)
+		fatal("stat %s:", name);
+	f->size = st.st_size;
+	if (f->size < 14)
+		fatal("%s: not a MIDI file", name);
+	f->map = mmap(NULL, f->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (f->map == MAP_FAILED)
+		fatal("mmap %s:", name);
+	close(fd);
+
+	pos = f->map;
+	end = pos + f->size;
+	len = getbe32(pos + 4);
+	if (memcmp(pos, "MThd", 4) != 0 || len < 6 || len > f->size - 8)
+		fatal("%s: not a MIDI file", name);
+	f->format = getbe16(pos + 8);
+	f->ntracks = getbe16(pos + 10);
+	f->division = getbe16(pos + 12);
+	if (f->division == 0)
+		fatal("%s: invalid division", name);
+	f->tracks = calloc(f->ntracks, sizeof *f->tracks);
+	f->heap = calloc(f->ntracks, sizeof *f->heap);
+	if (!f->tracks || !f->heap)
+		fatal("calloc:");
+	pos += 8 + len;
+	for (i = 0; i < f->ntracks && end - pos >= 8; pos += len) {
+		len = getbe32(pos + 4);
+		pos += 8;
+		if (len > (size_t)(end - pos))
+			fatal("%s: truncated chunk", name);
+		if (memcmp(pos - 8, "MTrk", 4) != 0)
+			continue;  /* unknown chunk */
+		f->tracks[i].pos = pos;
+		f->tracks[i].end = pos + len;
+		if (len > 0) {
+			f->tracks[i].tick = readvlq(f, &f->tracks[i].pos, pos + len);
+			if (f->tracks[i].pos == pos + len)
+				fatal("%s: truncated track", name);
+		}
+		++i;
+	}
+	f->ntracks = i;
+	tempomap(f);
+	for (i = 0; i < f->ntracks; ++i) {
+		if (f->tracks[i].pos != f->tracks[i].end)
+			f->heap[f->nheap++] = i;
+	}
+	buildheap(f);
+}
+
+/* takes the next event in time order across all tracks; returns 0 at the end */
+int
+smfnext(struct smf *f, struct smfevent *e)
+{
+	int i;
+
+	if (f->nheap == 0)
+		return 0;
+	i = f->heap[0];
+	e->track = i;
+	if (!readevent(f, &f->tracks[i], e))
+		f->heap[0] = f->heap[--f->nheap];
+	siftdown(f, 0);
+	e->time = ticktime(f, e->tick);
+	return 1;
+}
+
+void
+smfclose(struct smf *f)
+{
+	munmap(f->map, f->size);
+	free(f->tracks);
+	free(f->heap);
+	free(f->tempo);
+	free(f->index);
+}
+
+/* returns the tick at time t in nanoseconds */
+unsigned long long
+smftick(const struct smf *f, unsigned long long t)
+{
+	const struct smftempo *tm;
+	unsigned long long num, den;
+	size_t lo, hi, mid;
+
+	if (f->division & 0x8000) {
+		smpte(f, &num, &den);
+		return (long double)t * den / num;
+	}
+	lo = 0;
+	hi = f->ntempo;
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (f->tempo[mid].time <= t)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	tm = &f->tempo[lo];
+	return tm->tick + (t - tm->time) * f->division / (tm->tempo * 1000);
+}
+
+/* updates the channel state with a channel message */
+void
+smfchase(struct smfstate *st, const struct smfevent *e)
+{
+	int ch;
+
+	if (e->type >= 0xF0)
+		return;
+	ch = e->type & 0xF;
+	switch (e->type >> 4) {
+	case 0xB:
+		/* not channel mode messages */
+		if (e->msg[1] < 120)
+			st->ctl[ch][e->msg[1]] = e->msg[2];
+		break;
+	case 0xC: st->program[ch] = e->msg[1]; break;
+	case 0xD: st->pressure[ch] = e->msg[1]; break;
+	case 0xE: st->bend[ch] = e->msg[1] | e->msg[2] << 7; break;
+	}
+}
+
+/*
+Index record, little-endian:
+
+	tick (64), then for each track: byte offset of the next event (32),
+	its tick (64), running status (8), then the controllers (16 * 128),
+	programs (16), channel pressures (16), and pitch bends (16 * 16)
+
+The sidecar file has a header followed by the records in order of
+tick, so it can be used as is.
+*/
+static void
+addpoint(struct smf *f, unsigned long long tick, const struct smfstate *st, size_t *cap)
+{
+	unsigned char *rec;
+	int i;
+
+	if (f->npoints == *cap) {
+		*cap = *cap ? *cap * 2 : 64;
+		f->index = realloc(f->index, *cap * f->reclen);
+		if (!f->index)
+			fatal("realloc:");
+	}
+	rec = f->index + f->npoints++ * f->reclen;
+	rec = putle64(rec, tick);
+	for (i = 0; i < f->ntracks; ++i) {
+		rec = putle32(rec, f->tracks[i].pos - f->map);
+		rec = putle64(rec, f->tracks[i].tick);
+		*rec++ = f->tracks[i].runstatus;
+	}
+	memcpy(rec, st->ctl, sizeof st->ctl);
+	rec += sizeof st->ctl;
+	memcpy(rec, st->program, 16);
+	memcpy(rec + 16, st->pressure, 16);
+	rec += 32;
+	for (i = 0; i < 16; ++i)
+		rec = putle16(rec, st->bend[i]);
+}
+
+static int
+loadindex(struct smf *f, const char *path, const struct stat *st)
+{
+	unsigned char hdr[IDXHDR];
+	FILE *fp;
+	size_t len;
+
+	fp = fopen(path, "rb");
+	if (!fp)
+		return -1;
+	if (fread(hdr, 1, sizeof hdr, fp) != sizeof hdr || memcmp(hdr, "SMFI", 4) != 0
+	 || getle16(hdr + 4) != 1 || getle16(hdr + 6) != f->ntracks || getle32(hdr + 8) != f->interval
+	 || getle64(hdr + 12) != f->size || getle64(hdr + 20) != (uint_least64_t)st->st_mtime
+	 || getle32(hdr + 32) != f->reclen)
+		goto stale;
+	f->npoints = getle32(hdr + 28);
+	len = f->npoints * f->reclen;
+	f->index = malloc(len);
+	if (!f->index)
+		fatal("malloc:");
+	if (f->npoints == 0 || fread(f->index, 1, len, fp) != len) {
+		free(f->index);
+		f->index = NULL;
+		f->npoints = 0;
+		goto stale;
+	}
+	fclose(fp);
+	return 0;
+
+stale:
+	fclose(fp);
+	return -1;
+}
+
+/* writes the index to a temporary file, and moves it to path */
+static void
+saveindex(const struct smf *f, const char *path, const struct stat *st)
+{
+	unsigned char hdr[IDXHDR];
+	char *tmp;
+	FILE *fp;
+	size_t len;
+	int err;
+
+	len = strlen(path);
+	tmp = malloc(len + 5);
+	if (!tmp)
+		fatal("malloc:");
+	memcpy(tmp, path, len);
+	memcpy(tmp + len, ".tmp", 5);
+	memcpy(hdr, "SMFI", 4);
+	putle16(hdr + 4, 1);
+	putle16(hdr + 6, f->ntracks);
+	putle32(hdr + 8, f->interval);
+	putle64(hdr + 12, f->size);
+	putle64(hdr + 20, st->st_mtime);
+	putle32(hdr + 28, f->npoints);
+	putle32(hdr + 32, f->reclen);
+	/* the index is only a cache, so failing to save it is not an error */
+	fp = fopen(tmp, "wb");
+	if (fp) {
+		err = fwrite(hdr, 1, sizeof hdr, fp) != sizeof hdr;
+		err |= fwrite(f->index, f->reclen, f->npoints, fp) != f->npoints;
+		err |= fclose(fp) != 0;
+		if (err || rename(tmp, path) != 0)
+			remove(tmp);
+	}
+	free(tmp);
+}
+
+/*
+Loads the seek index from the sidecar file at path, or if it is missing
+or out of date, builds it by taking every event and saves it there.
+The index holds the track cursors and channel state at every multiple
+of interval ticks, or of one 4/4 bar (one second for SMPTE timing) if
+interval is 0. It must be called before any events are taken, and
+leaves the file at the start.
+*/
+void
+smfindex(struct smf *f, const char *path, unsigned long interval)
+{
+	struct stat st;
+	struct smfstate state;
+	struct smfevent e;
+	unsigned long long num, den, next, peek;
+	size_t cap;
+
+	if (interval == 0) {
+		interval = 4 * f->division;
+		if (f->division & 0x8000) {
+			smpte(f, &num, &den);
+			interval = den * 1000000000 / num;
+		}
+	}
+	if (f->size > 0xffffffff)
+		fatal("%s: too large to index", f->name);
+	f->interval = interval;
+	f->reclen = 8 + f->ntracks * IDXTRACK + IDXSTATE;
+	if (stat(f->name, &st) != 0)
+		fatal("stat %s:", f->name);
+	if (path && loadindex(f, path, &st) == 0)
+		return;
+	memset(&state, 0xff, sizeof state);
+	cap = 0;
+	for (next = 0;;) {
+		/* the cursors are at events no earlier than the one with the lowest tick */
+		peek = f->nheap > 0 ? f->tracks[f->heap[0]].tick : next;
+		for (; next <= peek; next += interval)
+			addpoint(f, next, &state, &cap);
+		if (!smfnext(f, &e))
+			break;
+		smfchase(&state, &e);
+	}
+	if (path)
+		saveindex(f, path, &st);
+	smfseek(f, 0, NULL);
+}
+
+/*
+Moves the track cursors to the first events at or after tick, starting
+from the last index point before it, and sets st (if not NULL) to the
+channel state at that time.
+*/
+void
+smfseek(struct smf *f, unsigned long long tick, struct smfstate *st)
+{
+	struct smfevent e;
+	const unsigned char *rec;
+	unsigned long off;
+	size_t lo, hi, mid;
+	int i;
+
+	if (f->npoints == 0)
+		fatal("%s: no seek index", f->name);
+	lo = 0;
+	hi = f->npoints;
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (getle64(f->index + mid * f->reclen) <= tick)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	rec = f->index + lo * f->reclen;
+	f->nheap = 0;
+	for (i = 0; i < f->ntracks; ++i) {
+		off = getle32(rec + 8 + i * IDXTRACK);
+		if (off > (size_t)(f->tracks[i].end - f->map))
+			fatal("%s: invalid seek index", f->name);
+		f->tracks[i].pos = f->map + off;
+		f->tracks[i].tick = getle64(rec + 8 + i * IDXTRACK + 4);
+		f->tracks[i].runstatus = rec[8 + i * IDXTRACK + 12];
+		if (f->tracks[i].pos != f->tracks[i].end)
+			f->heap[f->nheap++] = i;
+	}
+	buildheap(f);
+	if (st) {
+		rec += 8 + f->ntracks * IDXTRACK;
+		memcpy(st->ctl, rec, sizeof st->ctl);
+		rec += sizeof st->ctl;
+		memcpy(st->program, rec, 16);
+		memcpy(st->pressure, rec + 16, 16);
+		rec += 32;
+		for (i = 0; i < 16; ++i)
+			st->bend[i] = getle16(rec + i * 2);
+	}
+	/* ticktime only moves forward through the tempo map */
+	f->curtempo = 0;
+	while (f->nheap > 0 && f->tracks[f->heap[0]].tick < tick) {
+		smfnext(f, &e);
+		if (st)
+			smfchase(st, &e);
+	}
+}
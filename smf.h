@@ -0,0 +1,59 @@
+#ifndef SMF_H
+#define SMF_H
+
+#include <stddef.h>
+
+struct smftrack {
+	const unsigned char *pos, *end;
+	unsigned long long tick;  /* of the next event */
+	unsigned char runstatus;
+};
+
+struct smftempo {
+	unsigned long long tick, time;  /* time in nanoseconds */
+	unsigned long tempo;  /* microseconds per quarter note */
+};
+
+struct smf {
+	const char *name;
+	unsigned char *map;
+	size_t size;
+	int format, ntracks;
+	unsigned division;
+	struct smftrack *tracks;
+	struct smftempo *tempo;
+	size_t ntempo, curtempo;
+	int *heap;  /* tracks ordered by next event */
+	int nheap;
+	/* seek index, see smfindex */
+	unsigned char *index;
+	size_t npoints, reclen;
+	unsigned long interval;
+};
+
+struct smfevent {
+	unsigned long long tick, time;
+	int track;
+	int type;  /* status byte, 0xF0, or 0xF7 for system exclusive, 0xFF for meta */
+	int meta;  /* meta event type */
+	unsigned char msg[3];  /* channel message, with its status byte */
+	const unsigned char *data;
+	size_t len;
+};
+
+/* channel state chased when seeking */
+struct smfstate {
+	unsigned char ctl[16][128];  /* 0xFF if not set */
+	unsigned char program[16], pressure[16];
+	unsigned short bend[16];  /* 0xFFFF if not set */
+};
+
+void smfopen(struct smf *, const char *);
+int smfnext(struct smf *, struct smfevent *);
+void smfclose(struct smf *);
+unsigned long long smftick(const struct smf *, unsigned long long);
+void smfchase(struct smfstate *, const struct smfevent *);
+void smfindex(struct smf *, const char *, unsigned long);
+void smfseek(struct smf *, unsigned long long, struct smfstate *);
+
+#endif
@@ -0,0 +1,360 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <alsa/asoundlib.h>
+#include "arg.h"
+#include "fatal.h"
+#include "midiparse.h"
+#include "seqmidi.h"
+#include "smf.h"
+
+enum {
+	STARTDELAY = 100000000,  /* ns before the first event */
+	SYSEXCHUNK = 4096,  /* largest sysex event, well within the output buffer */
+};
+
+static snd_seq_t *seq;
+static int port, queue;
+static long long queuebase;
+static long lookahead = 500000;
+static unsigned long nevents, nrefills, maxrefill, nlate;
+static volatile sig_atomic_t done;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: smfplay [-v] [-a usec] [-n name] [-p client:port] [-s seconds] file\n");
+	exit(1);
+}
+
+static void
+onsignal(int sig)
+{
+	(void)sig;
+	done = 1;
+}
+
+/* queue real time in nanoseconds, extrapolated from the monotonic clock */
+static long long
+queuetime(void)
+{
+	return monotime() - queuebase;
+}
+
+/*
+Schedules a MIDI message on the queue at time t. System exclusive
+messages are split into chunks, since an event larger than the output
+buffer can never be written.
+*/
+static void
+schedule(const struct midimsg *msg, long long t)
+{
+	snd_seq_event_t evt;
+	snd_seq_real_time_t rt;
+	struct midimsg m;
+	size_t rem;
+	int err;
+
+	m = *msg;
+	rem = msg->len;
+	rt.tv_sec = t / 1000000000;
+	rt.tv_nsec = t % 1000000000;
+	do {
+		if (m.flags & MIDIMSG_SYSEX && rem > SYSEXCHUNK) {
+			m.len = SYSEXCHUNK;
+			m.flags &= ~MIDIMSG_EOX;
+		} else {
+			m.len = rem;
+			m.flags = msg->flags;
+		}
+		snd_seq_ev_clear(&evt);
+		if (!seqencode(&evt, &m))
+			return;
+		snd_seq_ev_set_source(&evt, port);
+		snd_seq_ev_set_subs(&evt);
+		snd_seq_ev_schedule_real(&evt, queue, 0, &rt);
+		err = snd_seq_event_output(seq, &evt);
+		if (err == -EINTR)
+			return;  /* interrupted while waiting for space in the pool */
+		if (err < 0)
+			fatal("snd_seq_event_output: %s", snd_strerror(err));
+		m.data += m.len;
+		rem -= m.len;
+	} while (rem > 0);
+	++nevents;
+}
+
+/* schedules the MIDI message of e on the queue at time t */
+static void
+submit(const struct smfevent *e, long long t)
+{
+	static unsigned char *buf;
+	static size_t bufsize;
+	struct midimsg m;
+
+	m.data = e->data;
+	m.len = e->len;
+	m.flags = 0;
+	switch (e->type) {
+	case 0xFF:
+		return;
+	case 0xF0:
+		/* the F0 is not part of the event data */
+		if (e->len + 1 > bufsize) {
+			bufsize = e->len + 1;
+			buf = realloc(buf, bufsize);
+			if (!buf)
+				fatal("realloc:");
+		}
+		buf[0] = 0xF0;
+		memcpy(buf + 1, e->data, e->len);
+		m.data = buf;
+		m.len = e->len + 1;
+		m.flags = MIDIMSG_SYSEX;
+		break;
+	case 0xF7:
+		/* escaped system common or real-time message, or system exclusive continuation */
+		if (e->len == 0)
+			return;
+		if (!(e->data[0] & 0x80) || e->data[0] == 0xF0 || e->data[0] == 0xF7 || e->len != (miditab[e->data[0]] & MIDI_LEN))
+			m.flags = MIDIMSG_SYSEX;
+		break;
+	}
+	if (m.flags & MIDIMSG_SYSEX && m.data[m.len - 1] == 0xF7)
+		m.flags |= MIDIMSG_EOX;
+	schedule(&m, t);
+}
+
+/* schedules the channel state chased to the seek position at time t */
+static void
+submitstate(const struct smfstate *st, long long t)
+{
+	/* parameter number selects before data entry, which applies to them */
+	static const unsigned char first[] = {101, 100, 99, 98, 6, 38};
+	unsigned char msg[3], order[128];
+	struct midimsg m;
+	int ch, i, n;
+
+	n = 0;
+	for (i = 0; i < (int)sizeof first; ++i)
+		order[n++] = first[i];
+	for (i = 0; i < 128; ++i) {
+		if (!memchr(first, i, sizeof first))
+			order[n++] = i;
+	}
+	m.data = msg;
+	m.flags = 0;
+	/* controllers first, so that bank selects precede program changes */
+	for (ch = 0; ch < 16; ++ch) {
+		msg[0] = 0xB0 | ch;
+		m.len = 3;
+		for (i = 0; i < 128; ++i) {
+			if (st->ctl[ch][order[i]] == 0xFF)
+				continue;
+			msg[1] = order[i];
+			msg[2] = st->ctl[ch][order[i]];
+			schedule(&m, t);
+		}
+	}
+	for (ch = 0; ch < 16; ++ch) {
+		m.len = 2;
+		if (st->program[ch] != 0xFF) {
+			msg[0] = 0xC0 | ch;
+			msg[1] = st->program[ch];
+			schedule(&m, t);
+		}
+		if (st->pressure[ch] != 0xFF) {
+			msg[0] = 0xD0 | ch;
+			msg[1] = st->pressure[ch];
+			schedule(&m, t);
+		}
+		if (st->bend[ch] != 0xFFFF) {
+			msg[0] = 0xE0 | ch;
+			msg[1] = st->bend[ch] & 0x7f;
+			msg[2] = st->bend[ch] >> 7;
+			m.len = 3;
+			schedule(&m, t);
+		}
+	}
+}
+
+/* silences the target after an interrupted playback */
+static void
+notesoff(void)
+{
+	snd_seq_event_t evt;
+	int ch, err;
+
+	snd_seq_ev_clear(&evt);
+	snd_seq_ev_set_source(&evt, port);
+	snd_seq_ev_set_subs(&evt);
+	snd_seq_ev_set_direct(&evt);
+	for (ch = 0; ch < 16; ++ch) {
+		snd_seq_ev_set_controller(&evt, ch, 123, 0);
+		err = snd_seq_event_output(seq, &evt);
+		if (err < 0)
+			fatal("snd_seq_event_output: %s", snd_strerror(err));
+	}
+	snd_seq_drain_output(seq);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct smf smf;
+	struct smfevent e;
+	struct smfstate state;
+	struct sigaction sa;
+	struct timespec ts;
+	struct rusage ru;
+	snd_seq_addr_t dest;
+	char *name, *target, *end, *idx;
+	long long offset, start, now, horizon, wake, t, cpu;
+	double seek;
+	unsigned long n;
+	int err, have, vflag;
+
+	name = "smfplay";
+	target = NULL;
+	vflag = 0;
+	seek = -1;
+	ARGBEGIN {
+	case 'a':
+		lookahead = strtol(EARGF(usage()), &end, 10);
+		if (*end || lookahead <= 0)
+			usage();
+		break;
+	case 'n':
+		name = EARGF(usage());
+		break;
+	case 'p':
+		target = EARGF(usage());
+		break;
+	case 's':
+		seek = strtod(EARGF(usage()), &end);
+		if (*end || !(seek >= 0))
+			usage();
+		break;
+	case 'v':
+		vflag = 1;
+		break;
+	default:
+		usage();
+	} ARGEND
+	if (argc != 1)
+		usage();
+
+	smfopen(&smf, argv[0]);
+	start = 0;
+	if (seek >= 0) {
+		/* the index is kept next to the file, and rebuilt when it changes */
+		idx = malloc(strlen(argv[0]) + 5);
+		if (!idx)
+			fatal("malloc:");
+		strcpy(idx, argv[0]);
+		strcat(idx, ".idx");
+		smfindex(&smf, idx, 0);
+		free(idx);
+		start = seek * 1e9;
+		smfseek(&smf, smftick(&smf, start), &state);
+	}
+
+	err = snd_seq_open(&seq, "default", SND_SEQ_OPEN_OUTPUT, 0);
+	if (err)
+		fatal("snd_seq_open: %s", snd_strerror(err));
+	err = snd_seq_set_client_name(seq, name);
+	if (err)
+		fatal("snd_seq_set_client_name: %s", snd_strerror(err));
+	port = snd_seq_create_simple_port(seq, name, SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ, SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+	if (port < 0)
+		fatal("snd_seq_create_simple_port: %s", snd_strerror(port));
+	if (target) {
+		err = snd_seq_parse_address(seq, &dest, target);
+		if (err)
+			fatal("snd_seq_parse_address '%s': %s", target, snd_strerror(err));
+		err = snd_seq_connect_to(seq, port, dest.client, dest.port);
+		if (err)
+			fatal("snd_seq_connect_to: %s", snd_strerror(err));
+	} else {
+		fprintf(stderr, "using port %d:%d\n", snd_seq_client_id(seq), port);
+	}
+	queue = snd_seq_alloc_named_queue(seq, name);
+	if (queue < 0)
+		fatal("snd_seq_alloc_named_queue: %s", snd_strerror(queue));
+	err = snd_seq_start_queue(seq, queue, NULL);
+	if (err)
+		fatal("snd_seq_start_queue: %s", snd_strerror(err));
+	err = snd_seq_drain_output(seq);
+	if (err < 0)
+		fatal("snd_seq_drain_output: %s", snd_strerror(err));
+	queuebase = seqqueuebase(seq, queue);
+
+	sa.sa_handler = onsignal;
+	sa.sa_flags = 0;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	/*
+	Events are parsed from the mapped file as they enter the lookahead
+	window, and then the process sleeps until half of the window has
+	been played.
+	*/
+	offset = queuetime() + STARTDELAY - start;
+	if (seek >= 0)
+		submitstate(&state, offset + start);
+	have = smfnext(&smf, &e);
+	while (have && !done) {
+		now = queuetime();
+		horizon = now + lookahead * 1000;
+		n = nevents;
+		for (; have && !done && (t = e.time + offset) <= horizon; have = smfnext(&smf, &e)) {
+			if (t < now)
+				++nlate;
+			submit(&e, t);
+		}
+		err = snd_seq_drain_output(seq);
+		if (err < 0 && err != -EINTR)
+			fatal("snd_seq_drain_output: %s", snd_strerror(err));
+		++nrefills;
+		if (nevents - n > maxrefill)
+			maxrefill = nevents - n;
+		if (!have)
+			break;
+		wake = e.time + offset - lookahead * 1000;
+		if (wake < now + lookahead * 500)
+			wake = now + lookahead * 500;
+		wake -= queuetime();
+		if (wake > 0) {
+			ts.tv_sec = wake / 1000000000;
+			ts.tv_nsec = wake % 1000000000;
+			nanosleep(&ts, NULL);
+		}
+	}
+	if (done) {
+		/* drop the scheduled events */
+		snd_seq_drop_output(seq);
+		err = snd_seq_free_queue(seq, queue);
+		if (err < 0)
+			fatal("snd_seq_free_queue: %s", snd_strerror(err));
+		notesoff();
+	} else {
+		/* wait for scheduled events to be delivered before exiting */
+		err = snd_seq_sync_output_queue(seq);
+		if (err < 0)
+			fatal("snd_seq_sync_output_queue: %s", snd_strerror(err));
+	}
+	if (vflag) {
+		getrusage(RUSAGE_SELF, &ru);
+		cpu = (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000ll + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+		fprintf(stderr, "smfplay: %lu events in %lu refills (max %lu per refill), %lu late, %.3f s cpu\n",
+			nevents, nrefills, maxrefill, nlate, cpu / 1e6);
+	}
+	smfclose(&smf);
+	snd_seq_close(seq);
+	return 0;
+}
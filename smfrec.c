@@ -0,0 +1,417 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "arg.h"
+#include "fatal.h"
+#include "intpack.h"
+#include "midiparse.h"
+
+enum {
+	FRAMEHDR = 12,      /* time (le64), client, port, length (le16) */
+	NBLOCK = 16,
+	BLOCKSIZE = 16384,
+	MAXTRACKS = 64,
+	TEMPO = 500000,     /* microseconds per quarter note */
+	MTRKLEN = 18,       /* offset of the first track length */
+};
+
+struct track {
+	FILE *fp;
+	int client, port;
+	unsigned long len;
+	unsigned long long tick;
+	unsigned char runstatus;
+	struct block *cur;
+};
+
+/* track data waiting to be written by the writer thread */
+struct block {
+	struct block *next;
+	struct track *track;
+	size_t len;
+	unsigned char data[BLOCKSIZE];
+};
+
+static struct block blocks[NBLOCK];
+static struct block *freeblocks, *queued, **queuetail = &queued;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queuedcond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t freecond = PTHREAD_COND_INITIALIZER;
+static int finished;
+
+static struct track tracks[MAXTRACKS];
+static size_t ntracks;
+static int format;
+static unsigned long division = 960;
+static unsigned long nevents, stalls;
+static volatile sig_atomic_t done;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: smfrec [-1v] [-d division] [-f rfd] file\n");
+	exit(1);
+}
+
+static void
+onsignal(int sig)
+{
+	(void)sig;
+	done = 1;
+}
+
+static void *
+writer(void *arg)
+{
+	struct block *b;
+
+	(void)arg;
+	pthread_mutex_lock(&lock);
+	for (;;) {
+		while (!queued && !finished)
+			pthread_cond_wait(&queuedcond, &lock);
+		b = queued;
+		if (!b)
+			break;
+		queued = b->next;
+		if (!queued)
+			queuetail = &queued;
+		pthread_mutex_unlock(&lock);
+		if (fwrite(b->data, 1, b->len, b->track->fp) != b->len)
+			fatal("write:");
+		pthread_mutex_lock(&lock);
+		b->next = freeblocks;
+		freeblocks = b;
+		pthread_cond_signal(&freecond);
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+static struct block *
+getblock(void)
+{
+	struct block *b;
+
+	pthread_mutex_lock(&lock);
+	if (!freeblocks) {
+		/* the disk is behind by NBLOCK blocks */
+		++stalls;
+		do pthread_cond_wait(&freecond, &lock);
+		while (!freeblocks);
+	}
+	b = freeblocks;
+	freeblocks = b->next;
+	pthread_mutex_unlock(&lock);
+	return b;
+}
+
+static void
+putblock(struct block *b)
+{
+	pthread_mutex_lock(&lock);
+	b->next = NULL;
+	*queuetail = b;
+	queuetail = &b->next;
+	pthread_cond_signal(&queuedcond);
+	pthread_mutex_unlock(&lock);
+}
+
+static void
+emit(struct track *t, const unsigned char *data, size_t len)
+{
+	struct block *b;
+	size_t n;
+
+	t->len += len;
+	while (len > 0) {
+		b = t->cur;
+		if (!b) {
+			b = t->cur = getblock();
+			b->track = t;
+			b->len = 0;
+		}
+		n = BLOCKSIZE - b->len;
+		if (n > len)
+			n = len;
+		memcpy(b->data + b->len, data, n);
+		b->len += n;
+		data += n;
+		len -= n;
+		if (b->len == BLOCKSIZE) {
+			putblock(b);
+			t->cur = NULL;
+		}
+	}
+}
+
+/* writes an event prefix of delta time, type, and length (unless -1) */
+static void
+emitprefix(struct track *t, uint_least32_t delta, int type, long len)
+{
+	unsigned char buf[12], *pos;
+
+	pos = putvlq(buf, delta);
+	*pos++ = type;
+	if (len >= 0)
+		pos = putvlq(pos, len);
+	emit(t, buf, pos - buf);
+}
+
+/* writes a meta event at delta time 0 */
+static void
+emitmeta(struct track *t, int type, const void *data, size_t len)
+{
+	unsigned char buf[8], *pos;
+
+	buf[0] = 0;
+	buf[1] = 0xff;
+	buf[2] = type;
+	pos = putvlq(buf + 3, len);
+	emit(t, buf, pos - buf);
+	emit(t, data, len);
+	t->runstatus = 0;
+}
+
+static struct track *
+gettrack(int client, int port)
+{
+	struct track *t;
+	char name[16];
+	size_t i;
+
+	if (format == 0)
+		return &tracks[0];
+	for (i = 0; i < ntracks; ++i) {
+		if (tracks[i].client == client && tracks[i].port == port)
+			return &tracks[i];
+	}
+	if (ntracks == MAXTRACKS)
+		fatal("too many senders");
+	t = &tracks[ntracks++];
+	t->client = client;
+	t->port = port;
+	/* spooled until the number of tracks is known */
+	t->fp = tmpfile();
+	if (!t->fp)
+		fatal("tmpfile:");
+	snprintf(name, sizeof name, "%d:%d", client, port);
+	emitmeta(t, 0x03, name, strlen(name));
+	return t;
+}
+
+static void
+record(const unsigned char *frame)
+{
+	static unsigned long long start;
+	struct track *t;
+	const unsigned char *m;
+	unsigned long long tick, time;
+	uint_least32_t delta;
+	unsigned char buf[3];
+	size_t len;
+
+	time = getle64(frame);
+	len = getle16(frame + 10);
+	m = frame + FRAMEHDR;
+	if (len == 0)
+		return;
+	if (nevents++ == 0)
+		start = time;
+	t = gettrack(frame[8], frame[9]);
+	tick = time > start ? (time - start) * division / (TEMPO * 1000ull) : 0;
+	delta = 0;
+	if (tick > t->tick) {
+		delta = tick - t->tick;
+		t->tick = tick;
+	}
+	if (m[0] >= 0x80 && m[0] < 0xF0) {
+		if (len > 3)
+			len = 3;
+		memcpy(buf, m, len);
+		len = midirunstatus(&t->runstatus, buf, len);
+		emitprefix(t, delta, buf[0], -1);
+		emit(t, buf + 1, len - 1);
+		return;
+	}
+	t->runstatus = 0;
+	if (m[0] == 0xF0) {
+		emitprefix(t, delta, 0xF0, len - 1);
+		emit(t, m + 1, len - 1);
+	} else {
+		/* system exclusive continuation, system common, or real-time */
+		emitprefix(t, delta, 0xF7, len);
+		emit(t, m, len);
+	}
+}
+
+static void
+putheader(FILE *fp, int ntrk)
+{
+	unsigned char hdr[14];
+
+	memcpy(hdr, "MThd", 4);
+	putbe32(hdr + 4, 6);
+	putbe16(hdr + 8, format);
+	putbe16(hdr + 10, ntrk);
+	putbe16(hdr + 12, division);
+	if (fwrite(hdr, 1, sizeof hdr, fp) != sizeof hdr)
+		fatal("write:");
+}
+
+static void
+puttrackhdr(FILE *fp, unsigned long len)
+{
+	unsigned char hdr[8];
+
+	memcpy(hdr, "MTrk", 4);
+	putbe32(hdr + 4, len);
+	if (fwrite(hdr, 1, sizeof hdr, fp) != sizeof hdr)
+		fatal("write:");
+}
+
+static void
+copytrack(FILE *out, struct track *t)
+{
+	unsigned char buf[BLOCKSIZE];
+	size_t n;
+
+	puttrackhdr(out, t->len);
+	rewind(t->fp);
+	while ((n = fread(buf, 1, sizeof buf, t->fp)) > 0) {
+		if (fwrite(buf, 1, n, out) != n)
+			fatal("write:");
+	}
+	if (ferror(t->fp))
+		fatal("read:");
+	fclose(t->fp);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static unsigned char buf[1 << 17];
+	static const unsigned char tempo[] = {TEMPO >> 16, TEMPO >> 8 & 0xff, TEMPO & 0xff};
+	struct sigaction sa;
+	sigset_t sigs, oldsigs;
+	pthread_t thread;
+	FILE *out;
+	unsigned char *pos, *end;
+	unsigned char trkhdr[8];
+	char *endp;
+	ssize_t ret;
+	size_t i, len;
+	int rfd, vflag, err;
+
+	rfd = 0;
+	vflag = 0;
+	ARGBEGIN {
+	case '1':
+		format = 1;
+		break;
+	case 'd':
+		division = strtoul(EARGF(usage()), &endp, 10);
+		if (*endp || division == 0 || division > 0x7fff)
+			usage();
+		break;
+	case 'f':
+		rfd = strtol(EARGF(usage()), &endp, 10);
+		if (*endp || rfd < 0)
+			usage();
+		break;
+	case 'v':
+		vflag = 1;
+		break;
+	default:
+		usage();
+	} ARGEND
+	if (argc != 1)
+		usage();
+
+	out = fopen(argv[0], "wb");
+	if (!out)
+		fatal("open %s:", argv[0]);
+	for (i = 0; i < NBLOCK; ++i) {
+		blocks[i].next = freeblocks;
+		freeblocks = &blocks[i];
+	}
+	if (format == 0) {
+		/* the track length is patched on close */
+		putheader(out, 1);
+		puttrackhdr(out, 0);
+		tracks[0].fp = out;
+		ntracks = 1;
+		emitmeta(&tracks[0], 0x51, tempo, sizeof tempo);
+	}
+
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &sigs, &oldsigs);
+	err = pthread_create(&thread, NULL, writer, NULL);
+	if (err)
+		fatal("pthread_create: %s", strerror(err));
+	pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+	/* no SA_RESTART, so that read is interrupted */
+	sa.sa_handler = onsignal;
+	sa.sa_flags = 0;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+
+	len = 0;
+	while (!done) {
+		ret = read(rfd, buf + len, sizeof buf - len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			fatal("read:");
+		}
+		if (ret == 0)
+			break;
+		len += ret;
+		end = buf + len;
+		for (pos = buf; end - pos >= FRAMEHDR && end - pos >= FRAMEHDR + getle16(pos + 10); pos += FRAMEHDR + getle16(pos + 10))
+			record(pos);
+		len = end - pos;
+		memmove(buf, pos, len);
+	}
+
+	for (i = 0; i < ntracks; ++i) {
+		emitmeta(&tracks[i], 0x2f, NULL, 0);
+		if (tracks[i].cur)
+			putblock(tracks[i].cur);
+	}
+	pthread_mutex_lock(&lock);
+	finished = 1;
+	pthread_cond_signal(&queuedcond);
+	pthread_mutex_unlock(&lock);
+	pthread_join(thread, NULL);
+
+	if (format == 0) {
+		putbe32(trkhdr, tracks[0].len);
+		if (fseek(out, MTRKLEN, SEEK_SET) != 0 || fwrite(trkhdr, 1, 4, out) != 4)
+			fatal("patch track length:");
+	} else {
+		/* conductor track, then the spooled tracks */
+		putheader(out, ntracks + 1);
+		puttrackhdr(out, 4 + sizeof tempo + 4);
+		if (fwrite("\x00\xff\x51\x03", 1, 4, out) != 4 || fwrite(tempo, 1, sizeof tempo, out) != sizeof tempo
+		 || fwrite("\x00\xff\x2f\x00", 1, 4, out) != 4)
+			fatal("write:");
+		for (i = 0; i < ntracks; ++i)
+			copytrack(out, &tracks[i]);
+	}
+	if (fclose(out) != 0)
+		fatal("close %s:", argv[0]);
+	if (vflag)
+		fprintf(stderr, "smfrec: %lu events, %zu tracks, %lu writer stalls\n", nevents, ntracks, stalls);
+	return 0;
+}
@@ -3,6 +3,40 @@
 #include "spawn.h"
 #include "fatal.h"
 
+/* moves p[0] to p[1] and p[2] to p[3], and runs argv */
+static void
+run(char *const argv[], int p[4])
+{
+	int i;
+
+	for (i = 0; i < 4; i += 2) {
+		if (p[i] == -1)
+			continue;
+		if (p[i] == p[i + 1]) {
+			if (fcntl(p[i], F_SETFD, 0) != 0)
+				fatal("fcntl:");
+			continue;
+		}
+		if (dup2(p[i], p[i + 1]) < 0)
+			fatal("dup2:");
+		close(p[i]);
+	}
+	execvp(argv[0], argv);
+	fatal("exec %s:", argv[0]);
+}
+
+/* swaps the dup order if the first would clobber the second source */
+static void
+order(int p[4])
+{
+	int t;
+
+	if (p[0] != -1 && p[2] != -1 && p[1] == p[2]) {
+		t = p[0], p[0] = p[2], p[2] = t;
+		t = p[1], p[1] = p[3], p[3] = t;
+	}
+}
+
 void
 spawn(const char *path, char *const argv[], int mode, int fd[2])
 {
@@ -27,13 +61,7 @@ spawn(const char *path, char *const argv[], int mode, int fd[2])
 		if (fcntl(t[0], F_SETFD, FD_CLOEXEC) != 0)
 			fatal("fcntl FD_CLOEXEC:");
 	}
-	if (mode == (READ | WRITE) && p[1] == p[2]) {
-		/* swap dup order to avoid clobber */
-		p[1] = p[3];
-		p[3] = p[2];
-		p[2] = p[0];
-		p[0] = p[3];
-	}
+	order(p);
 	pid = fork();
 	if (pid == -1)
 		fatal("fork");
@@ -43,18 +71,36 @@ spawn(const char *path, char *const argv[], int mode, int fd[2])
 		fd[0] = t[0];
 		fd[1] = t[1];
 	} else {
-		if (p[0] != -1 && p[0] != p[1]) {
-			if (dup2(p[0], p[1]) < 0)
-				fatal("dup2:");
-			close(p[0]);
-		}
-		if (p[2] != -1 && p[2] != p[3]) {
-			if (dup2(p[2], p[3]) < 0)
-				fatal("dup2:");
-			close(p[2]);
-		}
-		execvp(argv[0], argv);
-		fatal("exec %s:", argv[0]);
+		run(argv, p);
 	}
 }
 
+/*
+Like spawn, but rather than pipes, the command gets shared[0] as fd[0]
+and shared[1] as fd[1], which stay open in the caller as well. Either
+may be -1.
+
+As with spawn, the fork is the other way round from usual: the command
+is exec'd in the calling process, and the caller returns in the child.
+The command keeps the process ID it was started with, and the caller
+can use PR_SET_PDEATHSIG to exit when the command does, as it must,
+since a command that dies cannot close its rings. In exchange, the
+command gets a child it did not start, which it may see in wait.
+*/
+void
+spawnshared(char *const argv[], const int shared[2], int fd[2])
+{
+	pid_t pid;
+	int p[4];
+
+	p[0] = shared[0];
+	p[1] = fd[0];
+	p[2] = shared[1];
+	p[3] = fd[1];
+	order(p);
+	pid = fork();
+	if (pid == -1)
+		fatal("fork");
+	if (pid != 0)
+		run(argv, p);
+}
@@ -7,5 +7,6 @@ enum {
 };
 
 void spawn(const char *path, char *const argv[], int mode, int fd[2]);
+void spawnshared(char *const argv[], const int shared[2], int fd[2]);
 
 #endif
@@ -0,0 +1,502 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include "arg.h"
+#include "fatal.h"
+#include "intpack.h"
+#include "midiparse.h"
+
+enum {
+	HDRLEN = 14,
+	MAXPKT = 1200,     /* below common path MTUs */
+	MAXPAYLOAD = 512,  /* leaving the rest for the journal */
+	JENTRY = 5,        /* sequence number (le16), message */
+	NKEYS = 16 * 259,  /* notes, controllers, program, pressure, bend */
+	ACKDELAY = 20,     /* ms to wait for data to carry an acknowledgement */
+};
+
+/* packet flags */
+enum {
+	FACK = 1,    /* acknowledgement only, does not use a sequence number */
+	FACKED = 2,  /* the ack field is valid, after the first packet received */
+};
+
+/*
+Packet format, little-endian:
+
+	magic 'U', flags, seq (16), ack (16), MIDI length (16),
+	journal length (16), send time in microseconds (32),
+	MIDI bytes, journal entries
+
+The ack field is the last sequence number received, and is ignored
+unless FACKED is set.
+
+The journal holds the latest state of every note, controller,
+program, channel pressure, and pitch bend that changed since the last
+packet acknowledged by the peer, each tagged with the sequence number
+of the packet that changed it. When packets are lost, the receiver
+replays the entries that changed in the lost packets. When the journal
+does not fit in a packet, each packet continues where the last one
+stopped, so that every entry is sent eventually.
+*/
+
+struct journal {
+	unsigned short seq[NKEYS];
+	unsigned char msg[NKEYS][3];
+	unsigned char used[NKEYS];
+	unsigned short keys[NKEYS];
+	size_t nkeys;
+};
+
+static int sock;
+static int wfd = 1;
+static struct sockaddr_storage peer;
+static socklen_t peerlen;
+static long latency, droprate;
+static int vflag;
+static volatile sig_atomic_t done;
+
+static struct journal journal;
+static size_t jstart;  /* index of the key the next journal starts at */
+static unsigned char pkt[MAXPKT];
+static size_t pktlen;
+static unsigned short txseq;
+static long long batchdeadline;
+
+static unsigned short rxseq;  /* last received */
+static int rxstarted, rxinsysex;
+static long long ackdeadline;  /* -1 if nothing to acknowledge */
+
+static struct {
+	unsigned long sent, received, lost, recovered, late, dropped, omitted;
+	double jitter;
+	uint_least32_t transit;
+} stats;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: udpio [-v] [-d percent] [-L usec] [-l [host:]port] [-f rfd,wfd] [host port]\n");
+	exit(1);
+}
+
+static long long
+monotime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+/* whether sequence number a comes after b */
+static int
+seqafter(unsigned short a, unsigned short b)
+{
+	return (short)(a - b) > 0;
+}
+
+static void
+writefull(int fd, const unsigned char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(fd, buf, len);
+		if (ret < 0)
+			fatal("write:");
+		buf += ret;
+		len -= ret;
+	}
+}
+
+static int
+journalkey(const unsigned char *m)
+{
+	int ch;
+
+	ch = (m[0] & 0xF) * 259;
+	switch (m[0] >> 4) {
+	case 0x8:
+	case 0x9: return ch + m[1];
+	case 0xB: return ch + 128 + m[1];
+	case 0xC: return ch + 256;
+	case 0xD: return ch + 257;
+	case 0xE: return ch + 258;
+	}
+	return -1;
+}
+
+static void
+journalrecord(struct journal *j, const unsigned char *m, size_t len, unsigned short seq)
+{
+	int k;
+
+	k = journalkey(m);
+	if (k < 0)
+		return;
+	if (!j->used[k]) {
+		j->used[k] = 1;
+		j->keys[j->nkeys++] = k;
+	}
+	j->seq[k] = seq;
+	memset(j->msg[k], 0, 3);
+	memcpy(j->msg[k], m, len);
+}
+
+/* drops the entries the peer has received */
+static void
+journaltrim(struct journal *j, unsigned short ack)
+{
+	size_t i, n;
+	int k;
+
+	for (i = n = 0; i < j->nkeys; ++i) {
+		k = j->keys[i];
+		if (seqafter(j->seq[k], ack))
+			j->keys[n++] = k;
+		else
+			j->used[k] = 0;
+	}
+	j->nkeys = n;
+}
+
+static void
+sendpacket(int flags)
+{
+	unsigned char *pos, *end;
+	size_t i, n;
+	int k;
+
+	pos = pkt + HDRLEN + pktlen;
+	end = pkt + sizeof pkt;
+	if (!(flags & FACK) && journal.nkeys > 0) {
+		/* the keys may have been trimmed since the last packet */
+		if (jstart >= journal.nkeys)
+			jstart = 0;
+		for (i = jstart, n = 0; n < journal.nkeys; ++n) {
+			k = journal.keys[i];
+			if (++i == journal.nkeys)
+				i = 0;
+			if (journal.seq[k] == txseq)
+				continue;  /* in this packet */
+			if (end - pos < JENTRY) {
+				++stats.omitted;
+				continue;
+			}
+			pos = putle16(pos, journal.seq[k]);
+			memcpy(pos, journal.msg[k], 3);
+			pos += 3;
+			jstart = i;
+		}
+	}
+	pkt[0] = 'U';
+	pkt[1] = flags | (rxstarted ? FACKED : 0);
+	putle16(pkt + 2, txseq);
+	putle16(pkt + 4, rxseq);
+	putle16(pkt + 6, pktlen);
+	putle16(pkt + 8, pos - pkt - HDRLEN - pktlen);
+	putle32(pkt + 10, monotime() / 1000);
+	if (!(flags & FACK))
+		++txseq;
+	pktlen = 0;
+	ackdeadline = -1;
+	if (peerlen == 0)
+		return;  /* peer not known yet */
+	if (droprate > 0 && rand() % 100 < droprate) {
+		++stats.dropped;
+		return;
+	}
+	if (sendto(sock, pkt, pos - pkt, 0, (struct sockaddr *)&peer, peerlen) < 0 && errno != ECONNREFUSED)
+		fatal("sendto:");
+	++stats.sent;
+}
+
+/* appends MIDI bytes to the packet, sending it when it is full */
+static void
+addmidi(const struct midimsg *m)
+{
+	const unsigned char *data;
+	size_t len, n;
+
+	if (m->len <= 3 && MAXPAYLOAD - pktlen < m->len)
+		sendpacket(0);
+	if (pktlen == 0 && latency > 0)
+		batchdeadline = monotime() + latency * 1000;
+	if (!(m->flags & MIDIMSG_SYSEX))
+		journalrecord(&journal, m->data, m->len, txseq);
+	data = m->data;
+	len = m->len;
+	while (len > 0) {
+		n = MAXPAYLOAD - pktlen < len ? MAXPAYLOAD - pktlen : len;
+		memcpy(pkt + HDRLEN + pktlen, data, n);
+		pktlen += n;
+		data += n;
+		len -= n;
+		if (pktlen == MAXPAYLOAD)
+			sendpacket(0);
+	}
+}
+
+/* writes the MIDI in a received packet, recovering lost state from the journal */
+static void
+recvpacket(const unsigned char *buf, size_t len)
+{
+	const unsigned char *pos, *end, *m;
+	unsigned short seq, eseq;
+	size_t mlen, jlen, i;
+	uint_least32_t transit;
+	long d;
+
+	if (len < HDRLEN || buf[0] != 'U')
+		return;
+	seq = getle16(buf + 2);
+	mlen = getle16(buf + 6);
+	jlen = getle16(buf + 8);
+	if (HDRLEN + mlen + jlen > len)
+		return;
+	if (buf[1] & FACKED)
+		journaltrim(&journal, getle16(buf + 4));
+	if (buf[1] & FACK)
+		return;
+	++stats.received;
+
+	/* interarrival jitter, as in RFC 3550 */
+	transit = (monotime() / 1000 - getle32(buf + 10)) & 0xffffffff;
+	if (stats.received > 1) {
+		d = (long)((transit - stats.transit) & 0xffffffff);
+		if (d > 0x7fffffffl)
+			d -= 0x100000000l;
+		stats.jitter += ((d < 0 ? -d : d) - stats.jitter) / 16;
+	}
+	stats.transit = transit;
+
+	if (rxstarted && !seqafter(seq, rxseq)) {
+		++stats.late;
+		return;
+	}
+	pos = buf + HDRLEN;
+	end = pos + mlen;
+	if (rxstarted && seq != (unsigned short)(rxseq + 1)) {
+		stats.lost += (unsigned short)(seq - rxseq - 1);
+		if (rxinsysex) {
+			/* terminate the interrupted message */
+			writefull(wfd, (const unsigned char *)"\xF7", 1);
+			rxinsysex = 0;
+		}
+		for (i = 0; i + JENTRY <= jlen; i += JENTRY) {
+			eseq = getle16(end + i);
+			if (!seqafter(eseq, rxseq) || !seqafter(seq, eseq))
+				continue;
+			m = end + i + 2;
+			writefull(wfd, m, miditab[m[0]] & MIDI_LEN);
+			++stats.recovered;
+		}
+		/* skip a system exclusive continuation */
+		if (pos != end && !(*pos & 0x80))
+			pos = midifindstatus(pos, end);
+	}
+	rxseq = seq;
+	rxstarted = 1;
+	for (m = pos; m != end; ++m) {
+		if (*m >= 0x80 && *m < 0xF8)
+			rxinsysex = *m == 0xF0;
+	}
+	writefull(wfd, pos, end - pos);
+	if (ackdeadline == -1)
+		ackdeadline = monotime() + ACKDELAY * 1000000ll;
+}
+
+static void
+report(void)
+{
+	fprintf(stderr, "udpio: %lu sent, %lu dropped, %lu received, %lu lost, %lu recovered, %lu late, jitter %.0f us, %lu journal entries omitted\n",
+		stats.sent, stats.dropped, stats.received, stats.lost, stats.recovered, stats.late, stats.jitter, stats.omitted);
+}
+
+static void
+onsignal(int sig)
+{
+	(void)sig;
+	done = 1;
+}
+
+static struct addrinfo *
+resolve(const char *host, const char *port, int family, int flags)
+{
+	struct addrinfo hints, *ai;
+	int err;
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = family;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = flags;
+	err = getaddrinfo(host, port, &hints, &ai);
+	if (err)
+		fatal("getaddrinfo %s:%s: %s", host ? host : "*", port, gai_strerror(err));
+	return ai;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct addrinfo *remote, *local;
+	struct pollfd pfd[2];
+	struct midiparser parser = {0};
+	struct midimsg msg;
+	struct sigaction sa;
+	struct sockaddr_storage from;
+	socklen_t fromlen;
+	unsigned char buf[MAXPKT + 1];
+	char *lhost, *lport, *end;
+	long long now, t;
+	ssize_t ret;
+	size_t i, n;
+	int rfd, timeout, family;
+
+	rfd = 0;
+	lhost = NULL;
+	lport = NULL;
+	ARGBEGIN {
+	case 'v':
+		vflag = 1;
+		break;
+	case 'd':
+		droprate = strtol(EARGF(usage()), &end, 10);
+		if (*end || droprate < 0 || droprate > 100)
+			usage();
+		break;
+	case 'L':
+		latency = strtol(EARGF(usage()), &end, 10);
+		if (*end || latency < 0)
+			usage();
+		break;
+	case 'l':
+		lport = EARGF(usage());
+		end = strrchr(lport, ':');
+		if (end) {
+			lhost = lport;
+			*end = '\0';
+			lport = end + 1;
+		}
+		break;
+	case 'f':
+		rfd = strtol(EARGF(usage()), &end, 10);
+		wfd = rfd;
+		if (*end == ',')
+			wfd = strtol(end + 1, &end, 10);
+		if (*end || rfd < 0 || wfd < 0)
+			usage();
+		break;
+	default:
+		usage();
+	} ARGEND
+	if (argc != 0 && argc != 2)
+		usage();
+	if (argc == 0 && !lport)
+		usage();
+
+	family = AF_UNSPEC;
+	if (argc == 2) {
+		/* otherwise, the peer is the sender of the last packet */
+		remote = resolve(argv[0], argv[1], AF_UNSPEC, 0);
+		family = remote->ai_family;
+		memcpy(&peer, remote->ai_addr, remote->ai_addrlen);
+		peerlen = remote->ai_addrlen;
+		freeaddrinfo(remote);
+	}
+	if (lport) {
+		local = resolve(lhost, lport, family, AI_PASSIVE);
+		sock = socket(local->ai_family, SOCK_DGRAM, 0);
+		if (sock < 0)
+			fatal("socket:");
+		if (bind(sock, local->ai_addr, local->ai_addrlen) != 0)
+			fatal("bind:");
+		freeaddrinfo(local);
+	} else {
+		sock = socket(family, SOCK_DGRAM, 0);
+		if (sock < 0)
+			fatal("socket:");
+	}
+
+	sa.sa_handler = onsignal;
+	sa.sa_flags = 0;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	srand(getpid());
+
+	ackdeadline = -1;
+	pfd[0].fd = sock;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = rfd;
+	pfd[1].events = POLLIN;
+	while (!done) {
+		now = monotime();
+		timeout = -1;
+		if (pktlen > 0) {
+			t = batchdeadline - now;
+			timeout = latency == 0 || t <= 0 ? 0 : (t + 999999) / 1000000;
+		}
+		if (ackdeadline != -1) {
+			t = ackdeadline - now;
+			t = t <= 0 ? 0 : (t + 999999) / 1000000;
+			if (timeout == -1 || t < timeout)
+				timeout = t;
+		}
+		if (timeout != 0 && poll(pfd, 2, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			fatal("poll:");
+		}
+		if (pfd[0].revents & POLLIN) {
+			for (;;) {
+				fromlen = sizeof from;
+				ret = recvfrom(sock, buf, sizeof buf, MSG_DONTWAIT, (struct sockaddr *)&from, &fromlen);
+				if (ret < 0) {
+					if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNREFUSED)
+						break;
+					fatal("recvfrom:");
+				}
+				if (argc == 0) {
+					memcpy(&peer, &from, fromlen);
+					peerlen = fromlen;
+				}
+				recvpacket(buf, ret);
+			}
+		}
+		if (pfd[1].revents & (POLLIN | POLLHUP)) {
+			n = MAXPAYLOAD - pktlen;
+			ret = read(rfd, buf, n > 0 ? n : 1);
+			if (ret < 0)
+				fatal("read:");
+			if (ret == 0)
+				break;
+			for (i = 0; i < (size_t)ret; i += n) {
+				n = midiparse(&parser, buf + i, ret - i, &msg);
+				if (msg.len > 0)
+					addmidi(&msg);
+			}
+		}
+		pfd[0].revents = pfd[1].revents = 0;
+		now = monotime();
+		if (pktlen > 0 && (latency == 0 || now >= batchdeadline))
+			sendpacket(0);
+		/* pending MIDI goes out with the acknowledgement */
+		if (ackdeadline != -1 && now >= ackdeadline)
+			sendpacket(pktlen > 0 ? 0 : FACK);
+	}
+	if (pktlen > 0)
+		sendpacket(0);
+	if (vflag)
+		report();
+	return 0;
+}